@@ -60,7 +60,9 @@ def main(fname):
         ##     tvec[i], xref[i], yref[i], zref[i], zref[i], tref[i])
         ## str1 = '{0: f},{1: f},{2: f},{3: f},{4: f}\n'.format(
         ##     tvec[i], xref[i], yref[i], vd[i], wd[i])
-        str1 = '{0: f},{1: f},{2: f},{3: f}\n'.format(
+        ## more digits than the default 6, or the curvature of a
+        ## densely sampled path is lost in the rounding
+        str1 = '{0: .9f},{1: .9f},{2: .9f},{3: .9f}\n'.format(
             tvec[i], xref[i], yref[i], 12.0)
         f.write(str1);
     f.close()
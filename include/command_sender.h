@@ -0,0 +1,277 @@
+/*
+ * File:   command_sender.h
+ *
+ * Calls the serial node's command services from a thread of its own,
+ * so that a controller never waits on them.  Both services go through
+ * the one queue, so the commands to a robot go out in the order they
+ * were sent in, whichever service they use.
+ *
+ * This is a latest-value mailbox for each robot's control updates
+ * rather than a single slot: a command that hasn't gone out yet is
+ * replaced by a newer one of the same type for the same robot, so
+ * control updates never pile up behind a slow serial node, but a
+ * single slot would also lose changes of command (initial pose,
+ * start, stop), which all have to go out, and in order.  So the
+ * commands that can't be replaced wait behind each other.  A stop is
+ * a speed command with all the speeds zero, whatever its type; it is
+ * never replaced by a command that moves the robot, and never
+ * dropped.  Nor is a relative command (a time step, say), which is
+ * never replaced either, since the robot adds them up.  When too many
+ * commands are waiting, the oldest of the others is dropped.  One
+ * sender can be shared by several robots.  The connections to the
+ * services are kept open, and how the calls went is reported every
+ * SENDER_REPORT_PERIOD.
+ */
+
+#ifndef COMMAND_SENDER_H
+#define COMMAND_SENDER_H
+
+#include <ros/ros.h>
+#include <puppeteer_msgs/speed_command.h>
+#include <puppeteer_msgs/long_command.h>
+
+#include <deque>
+#include <string>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+
+#define SENDER_QUEUE (8)                // default limit on waiting commands
+#define SENDER_REPORT_PERIOD (10.0)     // seconds
+
+class CommandSender
+{
+public:
+    typedef puppeteer_msgs::speed_command::Request SpeedRequest;
+    typedef puppeteer_msgs::long_command::Request LongRequest;
+
+    CommandSender()
+	{
+	    running = false;
+	    limit = SENDER_QUEUE;
+	    clear_stats();
+	}
+    ~CommandSender()
+	{
+	    stop();
+	}
+
+    // a sender for several robots needs room for a command to each;
+    // long commands can only be sent once there is a service for them
+    void start(const std::string &name, unsigned int queue = SENDER_QUEUE)
+	{
+	    start(name, "", queue);
+	}
+    void start(const std::string &name, const std::string &long_name,
+	       unsigned int queue = SENDER_QUEUE)
+	{
+	    service = name;
+	    long_service = long_name;
+	    limit = queue;
+	    running = true;
+	    sender = boost::thread(&CommandSender::run, this);
+	}
+
+    // the commands already queued are sent before this returns
+    void stop(void)
+	{
+	    {
+		boost::mutex::scoped_lock lock(mutex);
+		running = false;
+		waiting.notify_all();
+	    }
+	    if (sender.joinable())
+		sender.join();
+	}
+
+    // queue a command to be sent; these never block on the services
+    void send(const SpeedRequest &req)
+	{
+	    Command c;
+	    c.robot = req.robot_index;
+	    c.type = req.type;
+	    c.is_long = false;
+	    c.relative = false;
+	    c.is_stop = (req.Vleft == 0 && req.Vright == 0 && req.Vtop == 0);
+	    c.speed = req;
+	    push(c);
+	}
+    void send(const LongRequest &req, bool relative = false)
+	{
+	    if (long_service.empty())
+	    {
+		ROS_ERROR_THROTTLE(5, "No service to send long commands to");
+		return;
+	    }
+	    Command c;
+	    c.robot = req.robot_index;
+	    c.type = req.type;
+	    c.is_long = true;
+	    c.relative = relative;
+	    c.is_stop = false;
+	    c.lng = req;
+	    push(c);
+	}
+
+private:
+    struct Command {
+	int robot;
+	char type;
+	bool is_long;           // which service it goes to
+	bool relative;          // can't be replaced or dropped
+	bool is_stop;           // can't be dropped
+	SpeedRequest speed;
+	LongRequest lng;
+    };
+
+    std::string service, long_service;
+    bool running;
+    unsigned int limit;         // commands that can wait at once
+    std::deque<Command> queue;
+    boost::thread sender;
+    boost::mutex mutex;
+    boost::condition waiting;   // signalled when a command is queued
+
+    // since the last report:
+    unsigned int sent, denied, failed, replaced, dropped;
+    double call_time, max_call_time;
+
+    void push(const Command &c)
+	{
+	    boost::mutex::scoped_lock lock(mutex);
+	    // the last command still waiting for the same robot:
+	    std::deque<Command>::reverse_iterator last;
+	    for (last=queue.rbegin(); last!=queue.rend(); ++last)
+		if (last->robot == c.robot)
+		    break;
+	    if (last != queue.rend() && last->type == c.type &&
+		last->is_long == c.is_long && !last->relative &&
+		!c.relative && (c.is_stop || !last->is_stop))
+	    {
+		*last = c;
+		replaced++;
+	    }
+	    else if (queue.size() < limit || make_room() ||
+		     c.is_stop || c.relative)
+		queue.push_back(c);
+	    else
+		dropped++;
+	    waiting.notify_one();
+	}
+
+    // drop the oldest command that can be dropped; returns false if
+    // there are none.  Called with the mutex held.
+    bool make_room(void)
+	{
+	    std::deque<Command>::iterator it;
+	    for (it=queue.begin(); it!=queue.end(); ++it)
+		if (!it->is_stop && !it->relative)
+		{
+		    queue.erase(it);
+		    dropped++;
+		    return true;
+		}
+	    return false;
+	}
+
+    void clear_stats(void)
+	{
+	    sent = denied = failed = replaced = dropped = 0;
+	    call_time = max_call_time = 0.0;
+	}
+
+    void run(void)
+	{
+	    ros::NodeHandle n;
+	    ros::ServiceClient client, long_client;
+	    ros::WallTime last_report = ros::WallTime::now();
+	    bool denied_notify = true;
+	    puppeteer_msgs::speed_command srv;
+	    puppeteer_msgs::long_command srv2;
+	    Command c;
+
+	    while (true)
+	    {
+		{
+		    boost::mutex::scoped_lock lock(mutex);
+		    while (running && queue.empty())
+			waiting.wait(lock);
+		    if (queue.empty())
+			return;
+		    c = queue.front();
+		    queue.pop_front();
+		}
+
+		// a persistent connection has to be made again once a
+		// call on it fails
+		const std::string &name = c.is_long ? long_service : service;
+		bool ok, error;
+		ros::WallTime t0 = ros::WallTime::now();
+		if (c.is_long)
+		{
+		    if (!long_client.isValid())
+			long_client = n.serviceClient<puppeteer_msgs::
+			    long_command>(long_service, true);
+		    srv2.request = c.lng;
+		    ok = long_client.call(srv2);
+		    error = srv2.response.error;
+		}
+		else
+		{
+		    if (!client.isValid())
+			client = n.serviceClient<puppeteer_msgs::
+			    speed_command>(service, true);
+		    srv.request = c.speed;
+		    ok = client.call(srv);
+		    error = srv.response.error;
+		}
+		ros::WallTime t1 = ros::WallTime::now();
+		double dt = (t1-t0).toSec();
+
+		if (!ok)
+		    ROS_ERROR_THROTTLE(1, "Failed to call service: %s",
+				       name.c_str());
+		else if (error == false)
+		    ROS_DEBUG("Send Successful: %s", name.c_str());
+		else
+		{
+		    ROS_DEBUG("Send Request Denied: %s", name.c_str());
+		    if (denied_notify)
+		    {
+			ROS_WARN("Send Requests Denied: %s", name.c_str());
+			denied_notify = false;
+		    }
+		}
+
+		boost::mutex::scoped_lock lock(mutex);
+		if (!ok)
+		    failed++;
+		else if (error)
+		    denied++;
+		else
+		    sent++;
+		call_time += dt;
+		if (dt > max_call_time)
+		    max_call_time = dt;
+		if ((t1-last_report).toSec() >= SENDER_REPORT_PERIOD)
+		{
+		    unsigned int calls = sent+denied+failed;
+		    ROS_INFO("%s%s%s: %u sent, %u denied, %u failed, "
+			     "%u replaced and %u dropped before sending; "
+			     "calls took %.1f ms on average and %.1f ms "
+			     "at most", service.c_str(),
+			     long_service.empty() ? "" : " and ",
+			     long_service.c_str(), sent, denied, failed,
+			     replaced, dropped, 1000.0*call_time/calls,
+			     1000.0*max_call_time);
+		    clear_stats();
+		    last_report = t1;
+		}
+	    }
+	}
+
+    CommandSender(const CommandSender &);
+    CommandSender &operator=(const CommandSender &);
+};
+
+#endif // COMMAND_SENDER_H
@@ -0,0 +1,148 @@
+/*
+ * File:   trajectory.h
+ *
+ * A reference trajectory for the controllers.  Each point holds the
+ * time, x and y read from a trajectory file, the feedforward
+ * velocities that follow from them, and any extra columns of the
+ * file (winch lengths, etc.).  Sampling at a time is O(1): uniformly
+ * spaced trajectories are indexed directly, and others keep a cursor
+ * that follows the time forward.
+ *
+ * Cubic splines through x and y are fit when a trajectory is read, so
+ * the reference pose, heading and feedforward velocities can be found
+ * at any time, however far apart the points are.  The feedforward
+ * velocities kept at each point are found from the points about
+ * TRAJ_FF_SPAN either side of it, the same way for a TrajectoryStream.
+ *
+ * Trajectories are either the text files that traj_gen.py writes or
+ * binary files made from them by traj_convert.  Binary files hold the
+ * points exactly as they are kept in memory, so they are mapped
+ * read-only instead of being parsed, and controllers on the same
+ * machine that follow the same file share its pages.
+ */
+
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// columns of each point:
+#define TRAJ_T (0)
+#define TRAJ_X (1)
+#define TRAJ_Y (2)
+#define TRAJ_VD (3)    // feedforward translational velocity
+#define TRAJ_WD (4)    // feedforward angular velocity
+#define TRAJ_XDD (5)   // second derivatives of the splines through x
+#define TRAJ_YDD (6)   // and y
+#define TRAJ_EXTRA (7) // the file's columns after t, x and y
+#define TRAJ_FILE_EXTRA (3) // where those start in a line of a text file
+#define TRAJ_FF_SPAN (0.1) // seconds either side for the feedforward terms
+#define TRAJ_FF_STEPS (16) // but no more points than this
+
+#define TRAJ_MAGIC (0x4A525450) // "PTRJ"
+#define TRAJ_VERSION (4)
+#define TRAJ_ALIGN (64) // of the points in a binary file
+
+// The header of a binary trajectory file.  The points follow at
+// offset, num rows of cols floats laid out as in memory; everything
+// is in the byte order of the machine that wrote it.  The extra
+// columns start at column extra_at of each row, and are the columns
+// of the text file from extra_from on, in order.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num;
+    uint32_t cols;
+    uint32_t uniform;
+    float dt;
+    uint32_t offset;
+    uint32_t extra_at;
+    uint32_t extra_from;
+    uint32_t reserved[7];
+} TrajHeader;
+
+// the reference at a time, from the splines
+typedef struct
+{
+    float x, y;
+    float th;  // heading
+    float v;   // translational velocity
+    float w;   // angular velocity
+} TrajSample;
+
+class Trajectory
+{
+public:
+    Trajectory();
+    ~Trajectory();
+
+    // read a file with a "num= N" line followed by N lines of
+    // "t,x,y" and then extra comma separated values, of which the
+    // first extra are kept (or all of them if extra is negative), or
+    // a binary file with at least extra extra columns; returns false
+    // if it can't be used
+    bool read(const std::string &filename, int extra);
+    // save as a binary file that read() can map
+    bool write(const std::string &filename) const;
+    bool mapped(void) const { return mapping != NULL; }
+
+    unsigned int size(void) const { return num; }
+    int columns(void) const { return cols; }
+    float final_time(void) const { return (*this)(num-1, TRAJ_T); }
+    float operator()(unsigned int i, int c) const
+	{ return data[i*cols+c]; }
+
+    // find the segment holding time t, so that t is between the
+    // times of points i-1 and i; returns i and sets mult to how
+    // far through the segment t is.  Times outside the trajectory
+    // hold its first or last point.
+    unsigned int find(float t, float &mult);
+
+    // sample the splines in segment i, as found by find(); the
+    // heading is that of the velocity, or of the segment if the
+    // trajectory stops
+    void sample(unsigned int i, float mult, TrajSample &s) const;
+
+    // the pieces of reading a file, for TrajectoryStream
+    static void parse_point(const std::string &line, int extra, float *p);
+    static void feedforward_span(unsigned int i, unsigned int n, float dt,
+				 unsigned int &lo, unsigned int &hi);
+    static void feedforward(float *p, const float *a, const float *b,
+			    const float *c);
+    static bool check_layout(const TrajHeader &head,
+			     const std::string &filename);
+
+    // interpolate column c of segment i
+    float interp(unsigned int i, float mult, int c) const
+	{
+	    float a = (*this)(i-1, c);
+	    return a+mult*((*this)(i, c)-a);
+	}
+
+private:
+    std::vector<float> vals;   // the points of a text file
+    const float *data;         // one row of cols values per point
+    void *mapping;             // of a binary file, or NULL
+    size_t mapping_len;
+    unsigned int num;
+    int cols;
+    bool uniform;              // are the times evenly spaced?
+    float dt;
+    unsigned int cursor;       // the segment find last returned
+
+    bool read_text(const std::string &filename, int extra);
+    bool read_binary(int fd, const std::string &filename, int extra);
+    void clear(void);
+    void set_splines(void);
+    unsigned int search(float t) const;
+
+    // the mapping can't be shared between copies
+    Trajectory(const Trajectory &);
+    Trajectory &operator=(const Trajectory &);
+};
+
+#endif // TRAJECTORY_H
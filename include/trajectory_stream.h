@@ -0,0 +1,97 @@
+/*
+ * File:   trajectory_stream.h
+ *
+ * A trajectory that is read while it is being followed.  A thread
+ * reads the file ahead of the controller a chunk at a time into a
+ * ring buffer, and points are dropped once the controller is past
+ * them, so only a window around the current time is ever held no
+ * matter how long the trajectory is.  The files are the same as for
+ * Trajectory; a text file with "num= 0" goes on until the end of the
+ * file, so that it can be a pipe from a program that makes the
+ * trajectory up as it goes.
+ */
+
+#ifndef TRAJECTORY_STREAM_H
+#define TRAJECTORY_STREAM_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+
+#include "trajectory.h"
+
+#define STREAM_CAPACITY (4096) // points held at once
+#define STREAM_CHUNK (256)     // points read at a time
+#define STREAM_BEHIND (TRAJ_FF_STEPS) // points kept before the current segment
+
+class TrajectoryStream
+{
+public:
+    TrajectoryStream();
+    ~TrajectoryStream();
+
+    // open the file and read its first chunk, then start reading
+    // the rest in the background; returns false if it can't be used
+    bool open(const std::string &filename, int extra);
+    void close(void);
+    // go back to the start of the trajectory, reading the file again
+    // if its first points have already been dropped; returns false if
+    // it can't be read again.  A pipe has to be written again.
+    bool rewind(void);
+
+    // point i of the trajectory, counting from its start.  Only the
+    // points from a little before the segment that find() last
+    // returned up to those read so far can be used.
+    float operator()(unsigned int i, int c) const
+	{ return ring[(i%STREAM_CAPACITY)*cols+c]; }
+
+    // as for Trajectory.  If the reader has fallen behind, times past
+    // the points read so far hold the last of them.
+    unsigned int find(float t, float &mult);
+    float interp(unsigned int i, float mult, int c) const
+	{
+	    float a = (*this)(i-1, c);
+	    return a+mult*((*this)(i, c)-a);
+	}
+
+    // has the trajectory ended before time t?
+    bool finished(float t);
+    // how many times find() has had to wait on the reader
+    unsigned int underruns(void) const { return underrun_count; }
+
+private:
+    std::ifstream file;
+    std::string filename;
+    bool binary;
+    int extra, cols;
+    unsigned int total;        // points in the file, or 0 if unknown
+    std::vector<float> ring;   // STREAM_CAPACITY rows of cols values
+
+    // points [first, ready) can be used, and points up to loaded
+    // have been read but may still need their feedforward terms.
+    // The reader only writes to points from ready on, so find() can
+    // hand out points without holding the lock.
+    unsigned int first, ready, loaded;
+    bool ended;                // the reader has read the last point
+    unsigned int cursor;
+    unsigned int underrun_count;
+
+    boost::thread reader;
+    boost::mutex mutex;
+    boost::condition space;    // signalled when points are dropped
+    bool stopping;
+
+    float *row(unsigned int i) { return &ring[(i%STREAM_CAPACITY)*cols]; }
+    bool open_file(void);
+    unsigned int read_chunk(void);
+    void run(void);
+    unsigned int search(unsigned int lo, unsigned int hi, float t) const;
+
+    TrajectoryStream(const TrajectoryStream &);
+    TrajectoryStream &operator=(const TrajectoryStream &);
+};
+
+#endif // TRAJECTORY_STREAM_H
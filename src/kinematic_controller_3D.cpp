@@ -39,6 +39,9 @@
 #include <string>
 #include <sstream>
 
+#include "command_sender.h"
+#include "trajectory_stream.h"
+
 
 //---------------------------------------------------------------------------
 // Global Variables
@@ -62,26 +65,20 @@ template <typename T> int sgn(T val)
 class KinematicControl{
 
 private:
-    typedef struct
-    {
-	int RobotMY;
-	float DT;
-	unsigned int num;
-	float vals[][6]; // unknown length;
-			 // t,x,y,velocity_desired,angvel_desired,rdot
-    } Trajectory;       
-
     int operating_condition;
-    Trajectory *traj;
+    TrajectoryStream traj;
+    int RobotMY;
     ros::NodeHandle n_;
-    ros::ServiceClient client;
+    CommandSender sender;
     ros::Subscriber sub;
     puppeteer_msgs::speed_command srv;
     puppeteer_msgs::RobotPose pose;
     bool start_flag;
+    // the stream drops the points it is done with, so the start
+    // pose is kept for the next run:
+    float start_x, start_y, start_th;
     float desired_x, desired_y, desired_th, actual_x, actual_y, actual_th;
     float vd, wd, rdotd;
-    unsigned int num;
     // Controller gains
     float k1, k2, k3;
     float zeta, b;
@@ -100,10 +97,10 @@ public:
 	}
 	
 	// Read in the trajectory:
-	traj = ReadControls(filename);
+	ReadControls(filename);
 
-	// Define service client:
-	client = n_.serviceClient<puppeteer_msgs::speed_command>("speed_command");
+	// Start sending commands:
+	sender.start("speed_command");
 	// Define subscriber:
 	sub = n_.subscribe("/robot_pose", 1, &KinematicControl::subscriber_cb, this);
 
@@ -134,15 +131,29 @@ public:
 	    {
 		if (start_flag == true)
 		{
+		    // a run that was stopped or has finished has moved
+		    // the trajectory on, so go back to its start:
+		    if (!traj.rewind())
+		    {
+			ROS_ERROR("Cannot restart the trajectory");
+			srv.request.robot_index = RobotMY;
+			srv.request.type = 'h';
+			srv.request.Vleft = 0.0;
+			srv.request.Vright = 0.0;
+			srv.request.Vtop = 0.0;
+			srv.request.div = 3;
+			ros::param::set("operating_condition", 3);
+			sender.send(srv.request);
+			return;
+		    }
 		    ROS_INFO("Beginning movement execution");
 
 		    // set parameters for sending initial pose
-		    srv.request.robot_index = traj->RobotMY;
+		    srv.request.robot_index = RobotMY;
 		    srv.request.type = 'l';
-		    srv.request.Vleft = traj->vals[0][1];
-		    srv.request.Vright = traj->vals[0][2];
-		    srv.request.Vtop = atan2(traj->vals[1][2]-traj->vals[0][2],
-					     traj->vals[1][1]-traj->vals[0][1]);
+		    srv.request.Vleft = start_x;
+		    srv.request.Vright = start_y;
+		    srv.request.Vtop = start_th;
 		    srv.request.div = 4;
 
 		    start_flag = false;
@@ -157,9 +168,8 @@ public:
 		    running_time = ((ros::Time::now()).toSec()-
 				    base_time.toSec());
 		    ROS_DEBUG("Running time is %f", running_time);
-		    ROS_DEBUG("Final time is %f", traj->vals[num-1][0]);
 		    // check that running_time is less than the final time:
-		    if (running_time <= traj->vals[num-1][0])
+		    if (!traj.finished(running_time))
 		    {
 			get_desired_pose(running_time);
 			get_control_values(pose);
@@ -168,7 +178,7 @@ public:
 		    {
 			// stop robot!
 			ROS_INFO("Trajectory Finished!");
-			srv.request.robot_index = traj->RobotMY;
+			srv.request.robot_index = RobotMY;
 			srv.request.type = 'h';
 			srv.request.Vleft = 0.0;
 			srv.request.Vright = 0.0;
@@ -183,7 +193,7 @@ public:
 	    else if (operating_condition == 4)
 	    {
 		ROS_WARN("Emergency Stop Detected!");
-		srv.request.robot_index = traj->RobotMY;
+		srv.request.robot_index = RobotMY;
 		srv.request.type = 'h';
 		srv.request.Vleft = 0.0;
 		srv.request.Vright = 0.0;
@@ -193,23 +203,7 @@ public:
 	    }
 	    
 	    // send request to service
-	    if(client.call(srv))
-	    {
-		if(srv.response.error == false)
-		    ROS_DEBUG("Send Successful: speed_command\n");
-		else
-		{
-		    ROS_DEBUG("Send Request Denied: speed_command\n");
-		    static bool request_denied_notify = true;
-		    if(request_denied_notify)
-		    {
-			ROS_INFO("Send Requests Denied: speed_command\n");
-			request_denied_notify = false;
-		    }
-		}
-	    }
-	    else 
-		ROS_ERROR("Failed to call service: speed_command\n");
+	    sender.send(srv.request);
 	}
 
     void get_desired_pose(float time)
@@ -221,35 +215,24 @@ public:
 
 	// first we iterate through the array to find the right
 	// time entry
-	unsigned int index;
 	float mult;
-	for (index=0; index<num; index++)
-	{
-	    if (traj->vals[index][0] > time)
-		break;
-	}
-	mult = (time-traj->vals[index-1][0])/traj->DT;
-	    desired_x = (traj->vals[index-1][1]) +
-		mult*(traj->vals[index][1]-traj->vals[index-1][1]);
-	    desired_y = (traj->vals[index-1][2]) +
-		mult*(traj->vals[index][2]-traj->vals[index-1][2]);
+	unsigned int index = traj.find(time, mult);
+	    desired_x = traj.interp(index, mult, TRAJ_X);
+	    desired_y = traj.interp(index, mult, TRAJ_Y);
 	    // now, let's estimate the desired orientation to do this
 	    // we just draw a straight line from the current point to
 	    // the next point
-	    desired_th = atan2(traj->vals[index][2]-desired_y,
-			       traj->vals[index][1]-desired_x);
+	    desired_th = atan2(traj(index,TRAJ_Y)-desired_y,
+			       traj(index,TRAJ_X)-desired_x);
 	    while (desired_th <= -M_PI)
 		desired_th += 2.0*M_PI;
 	    while (desired_th > M_PI)
 		desired_th -= 2.0*M_PI;
 
 	    // Now, we can interpolate the feedforward terms:
-	    vd = (traj->vals[index-1][3])+
-		mult*(traj->vals[index][3]-traj->vals[index-1][3]);
-	    wd = (traj->vals[index-1][4])+
-		mult*(traj->vals[index][4]-traj->vals[index-1][4]);
-	    rdotd = (traj->vals[index-1][5])+
-		mult*(traj->vals[index][5]-traj->vals[index-1][5]);
+	    vd = traj.interp(index, mult, TRAJ_VD);
+	    wd = traj.interp(index, mult, TRAJ_WD);
+	    rdotd = traj.interp(index, mult, TRAJ_EXTRA);
 
 	    rdotd = 0.0;
 	    ROS_DEBUG("Desired values at time t = %f", time);
@@ -313,7 +296,7 @@ public:
 	    ROS_DEBUG("Commands: v = %f\tomega = %f",v,omega);
 
 	    // Set service parameters:
-	    srv.request.robot_index = traj->RobotMY;
+	    srv.request.robot_index = RobotMY;
 	    srv.request.type = 'd';
 	    srv.request.Vleft = v;
 	    srv.request.Vright = omega;
@@ -327,7 +310,7 @@ public:
 	{
 	    ROS_DEBUG("Sending start flag");
 	    // First set the parameters for the service call
-	    srv.request.robot_index = traj->RobotMY;
+	    srv.request.robot_index = RobotMY;
 	    srv.request.type = 'm';
 	    srv.request.Vleft = 0.0;
 	    srv.request.Vright = 0.0;
@@ -335,99 +318,27 @@ public:
 	    srv.request.div = 0;
 
 	    // send request to service
-	    if(client.call(srv))
-	    {
-		if(srv.response.error == false)
-		    ROS_DEBUG("Send Successful: speed_command\n");
-		else
-		{
-		    ROS_DEBUG("Send Request Denied: speed_command\n");
-		    static bool request_denied_notify = true;
-		    if(request_denied_notify)
-		    {
-			ROS_INFO("Send Requests Denied: speed_command\n");
-			request_denied_notify = false;
-		    }
-		}
-	    }
-	    else 
-		ROS_ERROR("Failed to call service: speed_command\n");
+	    sender.send(srv.request);
 	}
 
 
-    Trajectory *ReadControls(std::string filename)
+    void ReadControls(std::string filename)
 	{
-	    unsigned int i,j;
-	    float temp_float, xd, xdd, yd, ydd, xdp, ydp;
-	    std::string line, temp;
-	    Trajectory *traj;
-	    std::ifstream file;
-	    file.open(filename.c_str(), std::fstream::in);
-	    // Read line telling us the number of data points:
-	    getline(file, line);
-	    std::stringstream ss(line);
-	    ss >> temp >> num;
-	    ROS_DEBUG("Number of time points = %d",num);
-
-	    // Now we can initialize the trajectory struct:
-	    size_t alloc;
-	    alloc = sizeof(*traj) + sizeof(traj->vals[0])*num;
-	    traj = (Trajectory*) malloc(alloc);
-	    
-	    // Now, we can start reading in the important file stuff:
-	    for (i=0; i<num; i++)
-	    {
-		for (j=0; j<3; j++)
-		{		
-		    getline(file, line, ',');
-		    std::stringstream ss(line);
-		    ss >> temp_float;
-		    traj->vals[i][j] = temp_float;
-		}
-		getline(file, line);
-		std::stringstream ss(line);
-		ss >> temp_float;
-		// fill out rdot
-		traj->vals[i][5] = temp_float;
-	    }
-	    file.close();
-	    
-	    // Now we can set DT and the robot_index
-	    ros::param::get("/robot_index", traj->RobotMY);
-	    traj->DT = traj->vals[1][0]-traj->vals[0][0];
-	    traj->num = num;
-
-	    // Now let's set the feedforward terms in the vals array:
-	    for (i=0; i<num-2; i++)
-	    {
-		xd = (traj->vals[i+1][1]-traj->vals[i][1])/
-		    (traj->vals[i+1][0]-traj->vals[i][0]);
-		yd = (traj->vals[i+1][2]-traj->vals[i][2])/
-		    (traj->vals[i+1][0]-traj->vals[i][0]);
-		xdp = (traj->vals[i+2][1]-traj->vals[i+1][1])/
-		    (traj->vals[i+2][0]-traj->vals[i+1][0]);
-		ydp = (traj->vals[i+2][2]-traj->vals[i+1][2])/
-		    (traj->vals[i+2][0]-traj->vals[i+1][0]);
-		xdd = (xdp-xd)/(traj->vals[i+1][0]-traj->vals[i][0]);
-		ydd = (ydp-yd)/(traj->vals[i+1][0]-traj->vals[i][0]);
-		// Now we can calculate the angular and translational
-		// velocities of the robot:
-		traj->vals[i][3] = sqrt(pow(xd,2)+pow(yd,2));
-		traj->vals[i][4] = (ydd*xd-xdd*yd)/(pow(xd,2)+pow(yd,2));
+	    if (!traj.open(filename, 1))
+		exit(1);
+	    start_x = traj(0,TRAJ_X);
+	    start_y = traj(0,TRAJ_Y);
+	    start_th = atan2(traj(1,TRAJ_Y)-traj(0,TRAJ_Y),
+			     traj(1,TRAJ_X)-traj(0,TRAJ_X));
 
-	    }
-	    // Now, let's fill out the last few entries:
-	    traj->vals[num-2][3] = traj->vals[num-3][3];
-	    traj->vals[num-2][4] = traj->vals[num-3][4];
-	    traj->vals[num-1][3] = traj->vals[num-3][3];
-	    traj->vals[num-1][4] = traj->vals[num-3][4];
+	    // Now we can set the robot_index
+	    ros::param::get("/robot_index", RobotMY);
 
 	    // let's set some parameters for the initial pose of the robot:
-	    ros::param::set("/robot_x0", traj->vals[0][1]);
-	    ros::param::set("/robot_z0", traj->vals[0][2]);
+	    ros::param::set("/robot_x0", start_x);
+	    ros::param::set("/robot_z0", start_y);
 	    ros::param::set("/robot_y0", 2.0);
 
-	    return traj;
 	}
 };
 
@@ -20,41 +20,155 @@
 #include <iterator>
 #include <stdio.h>
 #include <algorithm>
+#include <limits>
 
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <tf/transform_broadcaster.h>
-#include <tf/transform_listener.h>
 #include <tf/transform_datatypes.h>
 #include <tf_conversions/tf_eigen.h>
 #include <puppeteer_msgs/PointPlus.h>
 #include <puppeteer_msgs/Robots.h>
+#include <puppeteer_msgs/speed_command.h>
 #include <geometry_msgs/Point.h>
+#include <std_msgs/Float64.h>
 #include <ros/package.h>
 #include <nav_msgs/Odometry.h>
 #include <nav_msgs/Path.h>
 #include <Eigen/Core>
 #include <Eigen/Dense>
+#include <Eigen/Geometry>
+#include <Eigen/StdVector>
+#include <puppeteer_control/RobotRegistration.h>
+#include <puppeteer_control/FleetPose.h>
+
+#include "command_sender.h"
 
 
 //---------------------------------------------------------------------------
 // Global Variables
 //---------------------------------------------------------------------------
-#define MAX_ROBOTS (9)
-#define NUM_CALIBRATES (30)
+#define MIN_CALIBRATES (5) // frames before calibration can finish
+#define DEFAULT_MAX_CALIBRATES (90) // give up after this many frames
+#define DEFAULT_CAL_TOL (0.005) // meters, 95% interval on cal_pos
+#define CAL_CONFIDENCE_Z (1.96) // for a 95% interval
+#define CAL_OUTLIER_SIGMA (4.0) // reject points this far from the mean
+#define CAL_MIN_STD (0.002) // meters, floor for the outlier test
+#define CAL_OUTLIER_FRAMES (3) // points needed before rejecting any
+#define CAL_MIN_SPREAD (0.05) // meters, start spread needed to find rotation
+#define CAL_MAX_RESIDUAL (0.03) // meters, warn about robots fitting worse
 #define ROBOT_CIRCUMFERENCE (57.5) // centimeters
 #define DEFAULT_RADIUS (ROBOT_CIRCUMFERENCE/M_PI/2.0/100.) // meters
 #define NUM_EKF_INITS (5)
 #define NUM_FRAME_DELAYS (5)
-#define DEFAULT_ERR  (10)
 #define MIN_FREQ (10.0) // Hz
+#define DEFAULT_FRAME_BUDGET (0.03) // seconds of work per kinect frame
+#define MAX_SHED_FRAMES (3) // in a row, so that we never starve
+#define DEFAULT_SEARCH_RADIUS (0.25) // meters
+#define NO_PAIR_COST (1.0e6)
+#define DENSE_PAIR_LIMIT (4096) // use the grid above this many pairs
+#define NUM_CONFIRM_HITS (3)
+#define NUM_COAST_FRAMES (15)
+#define GATE_CHI2 (9.21) // 99% gate for 2 degrees of freedom
+#define WARM_CHI2 (4.0) // tight gate for keeping the nearest point
+#define WARM_MARGIN (4.0) // how much closer it must be than the rest
+#define WARM_REPORT_FRAMES (300)
+#define DEFAULT_STATE_FILE "coordinator_state.bin" // in ROS_HOME
+#define STATE_MAGIC (0x54534350) // "PCST"
+#define STATE_VERSION (1)
+#define STATE_SAVE_PERIOD (5.0) // seconds between saves while running
+#define STATE_START_TOL (0.001) // meters, start poses must match
+#define RESUME_CHECK_FRAMES (3) // frames that must agree with the state
+#define IDENT_SPEED (0.1) // m/s, for the identification motions
+#define IDENT_MOVE_TIME (0.5) // seconds of driving in each motion
+#define IDENT_SETTLE_TIME (0.5) // seconds to wait before measuring
+#define IDENT_MOVE_MIN (0.02) // meters, a robot that moved
+#define IDENT_STILL_MAX (0.01) // meters, a robot that didn't
+#define IDENT_MAX_TRIES (3) // before going back to the x ordering
+#define IDENT_SENDER_QUEUE (1024) // commands waiting to be sent
+#define CV_ACCEL_NOISE (2.0) // m^2/s^3
+#define MEAS_NOISE (0.02) // meters
+#define INIT_VEL_VAR (0.25) // (m/s)^2
+#define COAST_COV_GROWTH (2.0)
+#define TENTATIVE_COV_SCALE (10.0)
+#define LOST_COV_SCALE (1000.0)
+#define LOST_GATE_GROWTH (0.01) // meters per missed frame, for reacquiring
+#define LOST_GATE_MAX (1.0) // meters
+#define HEADING_WINDOW (10) // frames in the heading fit
+#define HEADING_REBASE (60.0) // seconds before the fit's times are shifted
+#define MIN_HEADING_VAR (0.01) // radians^2
+#define STATIC_FRAME_PERIOD (1.0) // seconds between calibration frames
+
+//---------------------------------------------------------------------------
+// Types
+//---------------------------------------------------------------------------
+// working space for solve_assignment, so that repeated solves of
+// similar sizes do not have to allocate
+typedef struct
+{
+    std::vector<double> u, v, minv;
+    std::vector<int> p, way;
+    std::vector<char> used;
+} AssignmentWork;
+
+typedef std::vector<std::pair<long long,int> > GridCells;
+
+// the points of a frame, as a view of a buffer that is only ever
+// grown, so that frames with different numbers of points can be
+// handled without allocating
+typedef Eigen::Map<Eigen::Matrix3Xd> PointsMap;
+
+// A triple buffer for handing the latest copy of something from one
+// writer thread to one reader thread.  The writer fills
+// write_buffer() and then calls publish(); the reader calls update()
+// to swap in the newest published buffer, if there is one, and then
+// reads read_buffer().  Neither side ever waits on the other, and an
+// unread buffer is simply replaced by a newer one.
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : write_idx(0), read_idx(1), middle(2) {}
+
+    T &write_buffer(void) { return bufs[write_idx]; }
+    const T &read_buffer(void) const { return bufs[read_idx]; }
+
+    void publish(void)
+	{
+	    __sync_synchronize();
+	    write_idx = __sync_lock_test_and_set(&middle, write_idx|FRESH) & ~FRESH;
+	    return;
+	}
+
+    bool update(void)
+	{
+	    if (!(middle & FRESH))
+		return false;
+	    read_idx = __sync_lock_test_and_set(&middle, read_idx) & ~FRESH;
+	    __sync_synchronize();
+	    return true;
+	}
+
+private:
+    enum { FRESH = 4 };
+    T bufs[3];
+    int write_idx, read_idx;
+    volatile int middle;
+};
 
 //---------------------------------------------------------------------------
 // Prototypes
 //---------------------------------------------------------------------------
-void add_to_tab(char reset, int num, int *p, int **tab);
-void move_perm_entry( int x, int d, int *p, int *pi);
-void permute(int n, int num, int *dir, int *p, int *pi, int **tab);
-void generate_perm_table(int num, int **tab);
+template <typename Derived>
+double solve_assignment(const Eigen::MatrixBase<Derived> &cost,
+			std::vector<int> &assign, AssignmentWork &work);
+long long grid_key(int ix, int iz);
+void find_gated_pairs(const Eigen::Matrix3Xd &tracks,
+		      const Eigen::VectorXd &gates,
+		      const PointsMap &points,
+		      double cell, GridCells &cells,
+		      std::vector<std::pair<int,int> > &pairs);
+int find_root(std::vector<int> &parent, int i);
 
 //---------------------------------------------------------------------------
 // Objects and Functions
@@ -62,83 +176,394 @@ void generate_perm_table(int num, int **tab);
 
 class Coordinator
 {
+    // test/coordinator_alloc.cpp drives the frame path directly
+    friend class CoordinatorAlloc;
 
 private:
+    // these match the constants in RobotEstimate.msg
+    typedef enum
+    {
+	TRACK_TENTATIVE,        // recently (re)acquired
+	TRACK_CONFIRMED,        // measured every frame
+	TRACK_COASTING,         // briefly missing, using prediction
+	TRACK_LOST              // missing for too long
+    } TrackState;
+
+    // steps of the identification motions; each step lasts until
+    // its time is up, and the motions repeat for every bit of the
+    // robots' codes
+    typedef enum
+    {
+	IDENT_OFF,              // use the start x ordering
+	IDENT_SETTLE,           // wait for the robots to stop
+	IDENT_MOVE,             // robots with the bit set drive forward
+	IDENT_MEASURE,          // wait, then see which ones moved
+	IDENT_RETURN,           // and drive them back
+	IDENT_DONE              // ident_ref holds each robot's position
+    } IdentPhase;
+
+    // Each track carries a constant-velocity filter in the ground
+    // plane of the kinect frame; the state is (x, z, xdot, zdot)
+    typedef struct
+    {
+	TrackState state;
+	int hits;               // consecutive frames with a point
+	int misses;             // consecutive frames without one
+	Eigen::Vector3d pos;    // last measured or predicted position
+	Eigen::Vector4d x;      // filter state
+	Eigen::Matrix4d P;      // filter covariance
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    } Track;
+
+    // The last HEADING_WINDOW measured positions of a robot in the
+    // optimization frame, with the running sums that a straight
+    // line fit of x and z against time needs.  Times are kept from
+    // base so that the sums don't lose precision.
+    typedef struct
+    {
+	double t[HEADING_WINDOW], x[HEADING_WINDOW], z[HEADING_WINDOW];
+	int next, count;
+	ros::Time base;
+	double st, stt, sx, sz, stx, stz, sxx, szz;
+    } HeadingWindow;
+
+    // Everything the coordinator keeps for one robot in the fleet
+    typedef struct
+    {
+	int id;                 // N in the /robot_N namespace
+	int index;              // robot_index for speed_command, or -1
+	ros::Publisher pub;     // /robot_N/vo
+	double radius;
+	Eigen::Vector3d start;  // robot_x0, robot_y0, robot_z0
+	double start_ori;       // robot_th0
+	nav_msgs::Odometry kin_pose;
+	Track track;
+	HeadingWindow heading;
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    } Robot;
+
+    // Everything the publishing side needs from one associated
+    // frame.  Points are sorted by fleet slot, and are already in
+    // the optimization frame.
+    typedef struct
+    {
+	unsigned int version;   // fleet_version when it was sorted
+	unsigned int resets;    // reset_count when it was sorted
+	ros::Time stamp;        // when the frame was received
+	ros::Time frame_stamp;  // when the kinect captured the frame
+	tf::Transform opt_pose; // of /optimization_frame in /oriented_...
+	tf::Transform map_pose; // of /map in /oriented_optimization_frame
+	Eigen::Matrix3Xd cur;
+	Eigen::VectorXd heading; // from the fit, with its variance
+	Eigen::VectorXd heading_var;
+	Eigen::Matrix3Xd map;   // cur moved into /map
+	bool resumed;           // calibrated from the saved state
+	std::vector<ros::Time> stamps; // kinect time of each point
+	Eigen::VectorXd cov_scale;
+	Eigen::VectorXd start_ori;
+	std::vector<int> states; // TrackState of each robot
+    } FleetSnapshot;
+
+    // everything that save_state writes to state_file, copied out
+    // on the ingest thread so that the saving thread can write it
+    typedef struct
+    {
+	Eigen::Matrix3d rot;
+	Eigen::Vector3d pos;
+	std::vector<int> ids, ord;
+	Eigen::Matrix3Xd start, tracks;
+    } SavedState;
+
+    // calls one of our methods on the thread of the queue that it is
+    // added to; datacb uses these to hand each new snapshot to the
+    // publishing thread, and the state to the saving thread
+    class MemberCall : public ros::CallbackInterface
+    {
+    public:
+	MemberCall(Coordinator *c, void (Coordinator::*f)(void)) :
+	    coord(c), fn(f) {}
+	virtual CallResult call()
+	    {
+		(coord->*fn)();
+		return Success;
+	    }
+    private:
+	Coordinator *coord;
+	void (Coordinator::*fn)(void);
+    };
+
+    // The coordinator runs three threads, each with its own callback
+    // queue.  The ingest thread runs datacb and the registry
+    // services, and owns the tracks and the calibration.  The
+    // publishing thread runs the timer and sends all of the tf
+    // frames and /vo messages.  Associated frames are handed over in
+    // snapshot, and fleet_mutex is only held while the fleet is
+    // being resized or published.  The saving thread writes
+    // state_file, so that the disk never holds up a frame.
     ros::NodeHandle n_;
+    ros::NodeHandle pub_nh;
+    ros::CallbackQueue ingest_queue, publish_queue, save_queue;
+    ros::CallbackInterfacePtr publish_call, save_call;
     ros::Subscriber robots_sub;
-    ros::Publisher robots_pub[MAX_ROBOTS];
+    ros::ServiceServer add_srv, remove_srv;
     ros::Timer timer;
+    boost::mutex fleet_mutex;
+    std::vector<Robot, Eigen::aligned_allocator<Robot> > fleet;
+    unsigned int fleet_version;
     int nr;
     bool calibrated_flag, gen_flag;
+    bool publish_on_data;      // publish from datacb instead of timercb
+    bool publish_fleet;        // also publish the whole fleet at once
+    ros::Publisher fleet_pub;
+    ros::Publisher latency_pub; // capture to publish, each frame
+    std_msgs::Float64 latency_msg;
+    puppeteer_control::FleetPose fleet_msg;
+    int num_delays;            // frames handled since calibrating
     unsigned int calibrate_count;
     ros::Time tstamp;
     std::vector<int> ref_ord;
-    int operating_condition;
-    std::vector<double> robot_radius;
-    tf::TransformListener tf;
+    // only written by timercb:
+    volatile int operating_condition;
+    volatile unsigned int reset_count;
+    unsigned int handled_resets;
+    TripleBuffer<FleetSnapshot> snapshot;
+    bool have_snapshot;
     tf::TransformBroadcaster br;
-    nav_msgs::Odometry kin_pose[MAX_ROBOTS];
-    puppeteer_msgs::Robots current_bots, prev_bots, start_bots, cal_bots;
+    std::vector<tf::StampedTransform> cal_frames;
+    // every transform for one cycle goes out in a single message:
+    std::vector<geometry_msgs::TransformStamped> tf_batch;
+    ros::Time static_stamp;     // when the calibration frames are due
+    tf::Quaternion map_rotation; // of /map in /oriented_optimization_frame
+    Eigen::Affine3d map_from_opt; // /optimization_frame to /map
+    puppeteer_msgs::Robots current_bots, start_bots, cal_bots;
     puppeteer_msgs::Robots current_bots_sorted, prev_bots_sorted;
     puppeteer_msgs::Robots desired_bots;
+    // the calibration takes a point p in /optimization_frame to
+    // cal_rot*p+cal_pos in /oriented_optimization_frame:
+    Eigen::Matrix3d cal_rot;
     Eigen::Vector3d cal_pos;
-    int **tab;
-    int height;
-    std::vector<double> robot_start_ori;
-    bool *bad_array;
+    Eigen::Affine3d opt_from_oo;  // the inverse of that
+    tf::Transform opt_pose, map_pose;
+    Eigen::Matrix3Xd raw_eig;   // sorted points before moving them
+    // streaming statistics of each robot's position while
+    // calibrating (Welford), one column per robot:
+    Eigen::Matrix3Xd cal_eig;   // running mean
+    Eigen::Matrix3Xd cal_m2;    // running sum of squared deviations
+    Eigen::VectorXi cal_n;      // accepted frames
+    unsigned int cal_rejects;
+    double cal_tol;             // meters
+    int cal_max_frames;
+    bool cal_failed;            // gave up until the next run
+    // the calibration, ordering and tracks are saved to state_file
+    // so that a restart can pick up where we left off:
+    std::string state_file;     // empty to disable
+    ros::Time last_save;
+    TripleBuffer<SavedState> saved;
+    bool state_checked;         // load_state has been tried
+    bool resume_pending;        // check the saved state before using it
+    bool resumed;
+    int resume_count;           // frames that have agreed with it
+    std::vector<int> resume_match;
+    // robots can be told apart by driving them instead of by the
+    // x ordering of their start positions:
+    bool identify_robots;
+    CommandSender speed_sender;
+    IdentPhase ident_phase;
+    ros::Time ident_start;      // when this step began
+    int ident_bit, ident_bits;  // the bit being sent, and how many
+    int ident_tries;
+    std::vector<int> ident_codes; // bits seen so far for each point
+    std::vector<int> ident_match;
+    Eigen::Matrix3Xd ident_pos; // the points, followed between frames
+    Eigen::Matrix3Xd ident_rest; // and where they were before moving
+    Eigen::Matrix3Xd ident_ref; // each robot's point once identified
+    // positions are kept one column per robot for the per-frame
+    // kernels:
+    Eigen::Matrix3Xd det_buf;   // room for the points of a frame
+    PointsMap det_eig;          // size-corrected points from the kinect
+    Eigen::Matrix3Xd track_eig; // predicted track positions
+    Eigen::Matrix3Xd sinv_eig;  // inverse innovation covariance (a,b,c)
+    Eigen::MatrixXd dist_eig;   // track to point Mahalanobis distances
+    unsigned int clutter_count;
+    unsigned int assign_tries, assign_hits; // for the fast path
     boost::array<double,36ul> kincov;
+    double kin_cov_ori;         // radians^2, when there is no heading
+    double search_radius;       // meters; see the constructor
+    // load shedding; all of these belong to the ingest thread
+    double frame_budget;        // seconds of work allowed per frame
+    bool over_budget;           // the last frame went over
+    int shed_run;               // frames shed in a row
+    bool seq_valid;
+    uint32_t last_seq;
+    unsigned int shed_count;    // stale frames we skipped
+    unsigned int dropped_count; // frames that never made it to us
+    unsigned int late_count;    // frames that went over budget
+    unsigned int order_count;   // frames that came out of order
+    ros::Time capture_stamp;    // when the kinect captured this frame
+    ros::Time last_capture;     // and the last one we used
+    // scratch space for the per-frame path.  These only ever grow, so
+    // once the fleet and the number of points settle down, datacb
+    // does not touch the heap.
+    Eigen::VectorXd gate_eig;   // euclidean reach of each track's gate
+    Eigen::RowVectorXd rad_eig; // radius correction for each point
+    Eigen::ArrayXXd dx_arr, dz_arr, dxz_arr;
+    Eigen::MatrixXd cost_eig;   // shared by all of the assignment solves
+    std::vector<std::pair<int,int> > pairs, near_pairs;
+    std::vector<double> pair_cost;
+    std::vector<int> pair_start; // first pair of each track
+    std::vector<int> parent, group, local;
+    std::vector<int> bot_start, pt_start, group_bots, group_pts;
+    std::vector<int> assign, sub_assign, lost_bots, left_pts;
+    std::vector<char> used;
+    GridCells grid_cells;
+    AssignmentWork assign_work;
+    // these have to go last so that they are stopped first:
+    ros::AsyncSpinner ingest_spinner, publish_spinner, save_spinner;
 
 public:
-    Coordinator() {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    Coordinator() : det_eig(NULL, 3, 0),
+		    ingest_spinner(1, &ingest_queue),
+		    publish_spinner(1, &publish_queue),
+		    save_spinner(1, &save_queue) {
 	ROS_DEBUG("Creating publishers and subscribers");
-	timer = n_.
+	n_.setCallbackQueue(&ingest_queue);
+	pub_nh.setCallbackQueue(&publish_queue);
+	publish_call.reset(new MemberCall(this, &Coordinator::publish_cb));
+	save_call.reset(new MemberCall(this, &Coordinator::write_state));
+	timer = pub_nh.
 	    createTimer(ros::Duration(0.033), &Coordinator::timercb, this);
 	robots_sub = n_.subscribe("robot_positions", 1,
 				  &Coordinator::datacb, this);
+	add_srv = n_.advertiseService("add_robot",
+				      &Coordinator::add_robot_cb, this);
+	remove_srv = n_.advertiseService("remove_robot",
+					 &Coordinator::remove_robot_cb, this);
 	// get the number of robots
+	int num = 1;
 	if (ros::param::has("/number_robots"))
-	    ros::param::get("/number_robots",nr);
+	    ros::param::get("/number_robots",num);
 	else
-	{
 	    ROS_WARN("Number of robots not set...");
-	    ros::param::set("/number_robots", 1);
-	    nr = 1;
+
+	// set operating condition to idle
+	ros::param::set("/operating_condition", 0);
+	operating_condition = 0;
+	reset_count = 0;
+	handled_resets = 0;
+	have_snapshot = false;
+
+	// how far from a robot to look for its point.  The association
+	// itself is gated by GATE_CHI2 on each track's own uncertainty;
+	// this only sets the cell size of the grid that finds nearby
+	// pairs in big problems, and how far the resume and
+	// identification matches reach.  It used to be called
+	// ~association_gate:
+	if (ros::param::has("~search_radius"))
+	    ros::param::get("~search_radius", search_radius);
+	else if (ros::param::has("~association_gate"))
+	{
+	    ROS_WARN("~association_gate no longer gates the association; "
+		     "use ~search_radius instead");
+	    ros::param::get("~association_gate", search_radius);
+	    ros::param::set("~search_radius", search_radius);
 	}
-	
-	for (int j=0; j<nr; j++)
+	else
 	{
-	    // create publishers
-	    std::stringstream ss;
-	    ss << "/robot_" << j+1 << "/vo";
-	    robots_pub[j] = n_.advertise<nav_msgs::Odometry>(ss.str(), 100);
+	    search_radius = DEFAULT_SEARCH_RADIUS;
+	    ros::param::set("~search_radius", search_radius);
 	}
 
-	// set operating condition to idle
-	ros::param::set("/operating_condition", 0);
+	// how long can we spend on each frame before we start
+	// shedding work?
+	if (ros::param::has("~frame_budget"))
+	    ros::param::get("~frame_budget", frame_budget);
+	else
+	{
+	    frame_budget = DEFAULT_FRAME_BUDGET;
+	    ros::param::set("~frame_budget", frame_budget);
+	}
+	over_budget = false;
+	shed_run = 0;
 
-	// get the size of the robot:
-	for (int j=0; j<nr; j++)
+	// when is the calibration good enough, and when should we
+	// give up on it?
+	if (ros::param::has("~calibration_tolerance"))
+	    ros::param::get("~calibration_tolerance", cal_tol);
+	else
 	{
-	    std::stringstream ss;
-	    double tmp = 0;
-	    ss << "/robot_" << j+1 << "/robot_radius";
-	    if(ros::param::has(ss.str()))
-	    {
-		ros::param::get(ss.str(), tmp);
-		robot_radius.push_back(tmp);
-	    }
-	    else
-		robot_radius.push_back( DEFAULT_RADIUS );	    
+	    cal_tol = DEFAULT_CAL_TOL;
+	    ros::param::set("~calibration_tolerance", cal_tol);
+	}
+	if (ros::param::has("~calibration_max_frames"))
+	    ros::param::get("~calibration_max_frames", cal_max_frames);
+	else
+	{
+	    cal_max_frames = DEFAULT_MAX_CALIBRATES;
+	    ros::param::set("~calibration_max_frames", cal_max_frames);
+	}
+	cal_failed = false;
+	ros::param::set("~calibration_failed", false);
+	// should we drive the robots to find out which one is which?
+	if (ros::param::has("~identify_robots"))
+	    ros::param::get("~identify_robots", identify_robots);
+	else
+	{
+	    identify_robots = false;
+	    ros::param::set("~identify_robots", identify_robots);
+	}
+	// every robot can be sent a command at once:
+	if (identify_robots)
+	    speed_sender.start("/speed_command", IDENT_SENDER_QUEUE);
+	ident_phase = IDENT_OFF;
+
+	// where do we keep the state for restarting?
+	if (ros::param::has("~state_file"))
+	    ros::param::get("~state_file", state_file);
+	else
+	{
+	    state_file = DEFAULT_STATE_FILE;
+	    ros::param::set("~state_file", state_file);
+	}
+	seq_valid = false;
+	last_seq = 0;
+	shed_count = dropped_count = late_count = order_count = 0;
+
+	// should the estimates go out as soon as each frame has been
+	// associated, or on the timer?
+	if (ros::param::has("~publish_on_data"))
+	    ros::param::get("~publish_on_data", publish_on_data);
+	else
+	{
+	    publish_on_data = true;
+	    ros::param::set("~publish_on_data", publish_on_data);
+	}
+
+	// should we also publish every robot in one message?
+	if (ros::param::has("~publish_fleet"))
+	    ros::param::get("~publish_fleet", publish_fleet);
+	else
+	{
+	    publish_fleet = false;
+	    ros::param::set("~publish_fleet", publish_fleet);
 	}
+	if (publish_fleet)
+	    fleet_pub = n_.advertise<puppeteer_control::FleetPose>
+		("fleet_pose", 10);
+	fleet_msg.header.frame_id = "map";
+	latency_pub = n_.advertise<std_msgs::Float64>
+	    ("coordinator_latency", 10);
 
 	// setup default values:
 	gen_flag = true;
 	calibrated_flag = false;
+	num_delays = 0;
 	tstamp = ros::Time::now();
 	    
 	// set covariance for the pose messages
 	double kin_cov_dist = 0.5;	// in meters^2
-	double kin_cov_ori = 100.0;	// radians^2
+	kin_cov_ori = 100.0;		// radians^2
 	boost::array<double,36ul> tmp = {{kin_cov_dist, 0, 0, 0, 0, 0,
 					  0, kin_cov_dist, 0, 0, 0, 0,
 					  0, 0,        99999, 0, 0, 0,
@@ -147,27 +572,187 @@ public:
 					  0, 0, 0, 0, 0,  kin_cov_ori}};
 	kincov = tmp;
 
-	for (int i=0; i<nr; i++)
-	    kin_pose[i].pose.covariance = kincov;
+	// build the frames that send_frames publishes; only their
+	// stamps and the calibration offsets change after this
+	tf::Transform transform(tf::Quaternion(0,0,0,1), tf::Vector3(0,0,0));
+	cal_frames.push_back(
+	    tf::StampedTransform(transform, tstamp,
+				 "/oriented_optimization_frame",
+				 "/optimization_frame"));
+	map_rotation = tf::Quaternion(.707107,0.0,0.0,-0.707107);
+	transform.setRotation(map_rotation);
+	cal_frames.push_back(
+	    tf::StampedTransform(transform, tstamp,
+				 "/oriented_optimization_frame", "/map"));
+	// the frame the robot calculates its odometry in:
+	transform.setRotation(tf::Quaternion(1,0,0,0));
+	cal_frames.push_back(
+	    tf::StampedTransform(transform, tstamp, "/map", "/robot_odom_pov"));
+
+	// register the initial fleet:
+	nr = 0;
+	fleet_version = 0;
+	for (int j=0; j<num; j++)
+	    register_robot(j+1);
+	clutter_count = 0;
+	assign_tries = assign_hits = 0;
+
+	// the saved state can only be checked once the start poses are
+	// known, which is once generate_order succeeds:
+	state_checked = false;
+	resume_pending = false;
+	resumed = false;
+	resume_count = 0;
+	return;
+    }
 
-	// initialize the size of the sorted bots messages:
-	current_bots_sorted.robots.resize(nr);
-	prev_bots_sorted.robots.resize(nr);
 
-	// allocate memory for the permuatation table:
-	height = 1;
-	for (int j=1; j<=nr; j++)
-	    height *= j;
-	tab = new int*[height];
-	for (int j=0; j<height; j++) 
-	    tab[j] = new int[nr];
-	generate_perm_table(nr, tab);
+    // nothing is handled until the spinners are started
+    void start(void)
+	{
+	    ingest_spinner.start();
+	    publish_spinner.start();
+	    save_spinner.start();
+	    return;
+	}
 
-	// allocate memory for bad_array
-	bad_array = new bool[nr];
 
-	return;
-    }
+    // add a robot to the end of the fleet, reading all of its
+    // parameters from the /robot_N namespace
+    void register_robot(int id)
+	{
+	    ROS_DEBUG("Registering robot %d", id);
+	    Robot r;
+	    r.id = id;
+	    r.index = -1;
+	    std::stringstream ss;
+	    ss << "/robot_" << id << "/vo";
+	    r.pub = n_.advertise<nav_msgs::Odometry>(ss.str(), 100);
+	    r.radius = DEFAULT_RADIUS;
+	    r.start.setZero();
+	    r.start_ori = 0.0;
+	    r.kin_pose.pose.covariance = kincov;
+	    r.kin_pose.header.frame_id = "map";
+	    ss.str("");
+	    ss << "base_footprint_kinect_robot_" << id-1;
+	    r.kin_pose.child_frame_id = ss.str();
+	    r.track.state = TRACK_LOST;
+	    clear_heading(r.heading);
+	    r.track.hits = 0;
+	    r.track.misses = 0;
+	    r.track.pos.setZero();
+	    fleet.push_back(r);
+	    nr = (int) fleet.size();
+	    load_robot_params(nr-1);
+
+	    // if we are already calibrated, the new robot should show
+	    // up near its start position:
+	    if (calibrated_flag)
+		fleet[nr-1].track.pos = cal_rot*fleet[nr-1].start+cal_pos;
+	    init_filter(nr-1);
+	    fleet_changed();
+	    return;
+	}
+
+
+    // read the radius and start pose of the robot in slot j; returns
+    // false if the start pose has not been set yet
+    bool load_robot_params(int j)
+	{
+	    Robot &r = fleet[j];
+	    std::stringstream ss;
+	    ss << "/robot_" << r.id << "/";
+	    std::string ns = ss.str();
+	    if (ros::param::has(ns+"robot_radius"))
+		ros::param::get(ns+"robot_radius", r.radius);
+	    if (ros::param::has(ns+"robot_index"))
+		ros::param::get(ns+"robot_index", r.index);
+	    if (!ros::param::has(ns+"robot_x0"))
+		return false;
+	    ros::param::get(ns+"robot_x0", r.start(0));
+	    ros::param::get(ns+"robot_y0", r.start(1));
+	    ros::param::get(ns+"robot_z0", r.start(2));
+	    ros::param::get(ns+"robot_th0", r.start_ori);
+	    return true;
+	}
+
+
+    // find the slot of a robot in the fleet, or -1
+    int find_robot(int id)
+	{
+	    for (int j=0; j<nr; j++)
+		if (fleet[j].id == id)
+		    return j;
+	    return -1;
+	}
+
+
+    // after adding or removing robots, resize everything that is
+    // indexed by slot and restart anything that depends on the
+    // ordering of the fleet.  Must be called with fleet_mutex held
+    // once the spinners are running.
+    void fleet_changed(void)
+	{
+	    nr = (int) fleet.size();
+	    fleet_version++;
+	    current_bots_sorted.robots.resize(nr);
+	    prev_bots_sorted.robots.resize(nr);
+	    ros::param::set("/number_robots", nr);
+	    gen_flag = true;
+	    calibrate_count = 0;
+	    resume_pending = false;
+	    stop_identification();
+	    return;
+	}
+
+
+    bool add_robot_cb(puppeteer_control::RobotRegistration::Request &req,
+		      puppeteer_control::RobotRegistration::Response &res)
+	{
+	    if (req.id < 1 || find_robot(req.id) >= 0)
+	    {
+		ROS_WARN("Cannot add robot %d", req.id);
+		res.error = true;
+	    }
+	    else
+	    {
+		ROS_INFO("Adding robot %d", req.id);
+		boost::mutex::scoped_lock lock(fleet_mutex);
+		register_robot(req.id);
+		res.error = false;
+	    }
+	    res.number_robots = nr;
+	    return true;
+	}
+
+
+    bool remove_robot_cb(puppeteer_control::RobotRegistration::Request &req,
+			 puppeteer_control::RobotRegistration::Response &res)
+	{
+	    int j = find_robot(req.id);
+	    if (j < 0)
+	    {
+		ROS_WARN("Cannot remove robot %d", req.id);
+		res.error = true;
+	    }
+	    else
+	    {
+		ROS_INFO("Removing robot %d", req.id);
+		boost::mutex::scoped_lock lock(fleet_mutex);
+		// fleet_changed only stops the robots that are left:
+		if (ident_phase == IDENT_MOVE || ident_phase == IDENT_RETURN)
+		    send_speed(j, 0.0);
+		fleet.erase(fleet.begin()+j);
+		current_bots_sorted.robots.erase(
+		    current_bots_sorted.robots.begin()+j);
+		prev_bots_sorted.robots.erase(
+		    prev_bots_sorted.robots.begin()+j);
+		fleet_changed();
+		res.error = false;
+	    }
+	    res.number_robots = nr;
+	    return true;
+	}
 
 
     void print_bots(const std::string name, const puppeteer_msgs::Robots &b)
@@ -194,112 +779,240 @@ public:
 
     
     
-    void datacb(const puppeteer_msgs::Robots &bots)
+    // Frames that sat in our queue for longer than frame_budget are
+    // shed, since a newer one is on its way, and after a frame that
+    // went over budget the next one skips the work that can wait.
+    // Frames captured before the last one we used are rejected.
+    void datacb(const ros::MessageEvent<puppeteer_msgs::Robots const> &event)
 	{
-	    ROS_DEBUG("coordinator datacb triggered with OC = %d",
-		     operating_condition);
-	    static bool first_flag = true;
-	    static ros::Time time;
+	    const puppeteer_msgs::Robots::ConstPtr &bots = event.getMessage();
+	    // the debugging output is the first thing to go when the
+	    // last frame went over budget, here and in associate_robots
+	    if (!over_budget)
+		ROS_DEBUG("coordinator datacb triggered with OC = %d",
+			  operating_condition);
+
+	    if (gen_flag)
+	    {
+		// Generate the robot ordering vector
+		gen_flag = generate_order();
+
+		// the controllers that set the start poses are usually
+		// started along with us, so this is the first time that
+		// we can tell if the saved state is for this fleet.  If
+		// it is, we can skip the calibration:
+		if (!gen_flag && !state_checked)
+		{
+		    state_checked = true;
+		    resume_pending = load_state();
+		    resume_count = 0;
+		}
+		return;
+	    }
+
+	    // has timercb seen us leave the run state since the last
+	    // frame?
+	    if (handled_resets != reset_count)
+	    {
+		handled_resets = reset_count;
+		if (calibrated_flag)
+		{
+		    // keep what we know for the next run:
+		    save_state();
+		    resume_pending = true;
+		    resume_count = 0;
+		}
+		calibrated_flag = false;
+		cal_failed = false;
+		resumed = false;
+		calibrate_count = 0;
+		stop_identification();
+	    }
 
 	    // if we aren't calibrating or running, let's just exit
 	    // this cb
 	    if (operating_condition != 2 && operating_condition != 1)
+	    {
+		seq_valid = false;
+		last_capture = ros::Time();
+		return;
+	    }
+
+	    // everything that depends on the spacing of the frames
+	    // uses the time the kinect captured them.  A frame that
+	    // was captured before the last one we used came in out of
+	    // order, and is too late to be of any use.
+	    capture_stamp = bots->header.stamp;
+	    if (capture_stamp.isZero())
+		capture_stamp = event.getReceiptTime();
+	    if (!last_capture.isZero() && capture_stamp <= last_capture)
+	    {
+		order_count++;
+		ROS_WARN_THROTTLE(1, "Coordinator rejected %u frames that "
+				  "arrived out of order", order_count);
 		return;
-	    puppeteer_msgs::Robots b;
-	    b.robots.resize(bots.robots.size());
-	    b = bots;
+	    }
+
+	    // count the frames that were dropped before they got to us:
+	    if (seq_valid && bots->header.seq > last_seq+1)
+		dropped_count += bots->header.seq-last_seq-1;
+	    last_seq = bots->header.seq;
+	    seq_valid = true;
+
+	    // if this frame waited in our queue for longer than its
+	    // whole budget, we are falling behind, so skip it and wait
+	    // for a fresh one
+	    if (calibrated_flag && shed_run < MAX_SHED_FRAMES &&
+		(ros::Time::now()-event.getReceiptTime()).toSec() > frame_budget)
+	    {
+		shed_count++;
+		shed_run++;
+		ROS_WARN_THROTTLE(1, "Coordinator shed %u stale frames, "
+				  "%u dropped before arriving",
+				  shed_count, dropped_count);
+		return;
+	    }
+	    shed_run = 0;
+	    ros::WallTime start = ros::WallTime::now();
 
 	    tstamp = ros::Time::now();
 	    
-	    // correct the points in bots
-	    b = adjust_for_robot_size(b);
+	    // correct the points in bots; the corrected points only
+	    // live in det_eig
+	    adjust_for_robot_size(*bots);
 
-	    // store the values that we received:
-	    if (first_flag) {
+	    if (last_capture.isZero()) {
 		ROS_DEBUG("First call!");
-	    	current_bots = b;
-	    	prev_bots = b;
-	    	first_flag = false;
-		time = ros::Time::now();
+		last_capture = capture_stamp;
 	    	return;
 	    }
 
 	    // check for timeout:
-	    ros::Duration dt = ros::Time::now()-time;
-	    time = ros::Time::now();
+	    ros::Duration dt = capture_stamp-last_capture;
+	    last_capture = capture_stamp;
 	    if (dt.toSec() > 1.0/MIN_FREQ)
-		ROS_WARN("Coordinator frequency dropping - %f Hz",
-			 1/dt.toSec());
+		ROS_WARN_THROTTLE(1, "Coordinator frequency dropping - %f Hz",
+				  1/dt.toSec());
 		
-
-	    // store arrangements:
-	    prev_bots = current_bots;
-	    current_bots = b;
-	    
-	    // do we need to calibrate?
+	    // do we need to calibrate?  This is the only place that
+	    // needs its own copy of the message.
 	    if ( !calibrated_flag )
 	    {
-		if ((int) current_bots.robots.size() == nr)
+		int nd = (int) bots->robots.size();
+		if (nd == nr || (resume_pending && nd > nr))
 		{
+		    current_bots = *bots;
+		    eigen_to_bots(det_eig, &current_bots);
 		    prev_bots_sorted = current_bots_sorted;
-		    current_bots_sorted = calibrate_routine();
+		    if (resume_pending)
+			current_bots_sorted = check_saved_state();
+		    else if (!cal_failed)
+			current_bots_sorted = calibrate_routine();
 		}
 	    	return;
 	    }
 	    
-	    // send all relevant transforms
-	    if (calibrated_flag)
-		send_frames();
-
 	    // If we got here, we are calibrated.  That means we can
 	    // sort robots based on previous locations
-	    puppeteer_msgs::Robots tmp;
-	    tmp.robots.resize(current_bots_sorted.robots.size());
-	    tmp = current_bots_sorted;
-	    // print_bots("tmp_bots (before)",tmp);
-	    current_bots_sorted = associate_robots(current_bots, prev_bots_sorted);
-	    prev_bots_sorted = tmp;
+	    associate_robots(*bots, dt.toSec());
+
+	    // and hand them over to the publishing thread:
+	    store_snapshot();
+	    if (publish_on_data)
+		publish_queue.addCallback(publish_call);
+
+	    double elapsed = (ros::WallTime::now()-start).toSec();
+	    over_budget = (elapsed > frame_budget);
+	    if (!over_budget &&
+		(tstamp-last_save).toSec() > STATE_SAVE_PERIOD)
+		save_state();
+	    if (over_budget)
+	    {
+		late_count++;
+		ROS_WARN_THROTTLE(1, "Coordinator frame took %f s of a %f s "
+				  "budget (%u late, %u shed, %u dropped)",
+				  elapsed, frame_budget, late_count,
+				  shed_count, dropped_count);
+	    }
+	    return;
+	}
+
 
+    // copy everything that the publishing side needs out of the
+    // sorted frame into the next snapshot
+    void store_snapshot(void)
+	{
+	    FleetSnapshot &s = snapshot.write_buffer();
+	    s.version = fleet_version;
+	    s.resets = handled_resets;
+	    s.stamp = tstamp;
+	    s.opt_pose = opt_pose;
+	    s.map_pose = map_pose;
+	    bots_to_eigen(&raw_eig, &current_bots_sorted);
+	    s.cur.resize(3, nr);
+	    s.cur.noalias() = opt_from_oo.linear()*raw_eig;
+	    s.cur.colwise() += opt_from_oo.translation();
+	    s.map.resize(3, nr);
+	    s.map.noalias() = map_from_opt.linear()*s.cur;
+	    s.map.colwise() += map_from_opt.translation();
+	    s.resumed = resumed;
+	    s.frame_stamp = capture_stamp;
+	    s.stamps.resize(nr);
+	    s.cov_scale.resize(nr);
+	    s.start_ori.resize(nr);
+	    s.states.resize(nr);
+	    s.heading.resize(nr);
+	    s.heading_var.resize(nr);
+	    for (int i=0; i<nr; i++)
+	    {
+		// points that don't carry their own time were
+		// captured with the frame:
+		s.stamps[i] = current_bots_sorted.robots[i].header.stamp;
+		if (s.stamps[i].isZero())
+		    s.stamps[i] = capture_stamp;
+		s.cov_scale(i) = track_cov_scale(i);
+		s.start_ori(i) = fleet[i].start_ori;
+		s.states[i] = fleet[i].track.state;
+
+		// only measured points go into the heading fit:
+		HeadingWindow &w = fleet[i].heading;
+		if (fleet[i].track.state == TRACK_LOST)
+		    clear_heading(w);
+		else if (fleet[i].track.misses == 0)
+		    add_heading_point(w, s.stamps[i], s.cur(0,i), s.cur(2,i));
+		fit_heading(w, s.heading(i), s.heading_var(i));
+	    }
+	    snapshot.publish();
 	    return;
 	}
 	
     
 
+    // In the default mode this only supervises the state of the
+    // coordinator, and the estimates are published as soon as datacb
+    // hands each frame over.  With ~publish_on_data turned off, this
+    // also publishes the latest estimates at a fixed rate.  This runs
+    // on the publishing thread.
     void timercb(const ros::TimerEvent& e)
 	{
-	    static int num_delays = 0;
 	    ROS_DEBUG("coordinator timercb triggered");
-	    if (gen_flag)
-	    {
-		// Generate the robot ordering vector
-		gen_flag = generate_order();
-		return;
-	    }
-
 	    // get operating condition
+	    int op = 4;
 	    if (ros::param::has("/operating_condition"))
-		ros::param::get("/operating_condition", operating_condition);
+		ros::param::get("/operating_condition", op);
 	    else
-	    {
-		operating_condition = 4;
-		ros::param::set("/operating_condition", operating_condition);
-	    }
+		ros::param::set("/operating_condition", op);
+	    operating_condition = op;
 	    
 	    // check to see if we are in run state
-	    if(operating_condition == 1 || operating_condition == 2)
+	    if(op == 1 || op == 2)
 	    {
-		if(calibrated_flag)
+		if (!publish_on_data)
 		{
-		    if (num_delays < NUM_FRAME_DELAYS)
-		    {
-			num_delays++;
-			return;
-		    }
-		    else if (num_delays < NUM_EKF_INITS+NUM_FRAME_DELAYS)
-			process_robots(1);
-		    else
-			process_robots(operating_condition);
-		    num_delays++;
+		    if (snapshot.update())
+			have_snapshot = true;
+		    if (have_snapshot)
+			publish_estimates();
 		}
 		return;
 	    }
@@ -316,9 +1029,78 @@ public:
 	    else
 		ROS_ERROR("Invalid value for operating_condition");
 
-	    calibrated_flag = false;
-	    calibrate_count = 0;
+	    // datacb will restart the calibration on its next frame
+	    reset_count++;
+	    have_snapshot = false;
 	    num_delays = 0;
+	    static_stamp = ros::Time();
+	    return;
+	}
+
+
+    // runs on the publishing thread each time datacb stores a new
+    // snapshot; if several frames came in while we were busy, only
+    // the newest one gets published
+    void publish_cb(void)
+	{
+	    if (operating_condition != 1 && operating_condition != 2)
+		return;
+	    if (snapshot.update())
+		publish_estimates();
+	    return;
+	}
+    
+
+    // publish the snapshot in read_buffer().  We skip the first few
+    // frames after calibrating, send a few with the predetermined
+    // orientations so that the EKFs can initialize, and then start
+    // sending the real estimates.  All of the transforms for the
+    // cycle go out in one tf message, and the calibration frames
+    // are only added to it once every STATIC_FRAME_PERIOD.
+    // Snapshots that were sorted before the fleet last changed, or
+    // before the last reset, are dropped.
+    void publish_estimates(void)
+	{
+	    const FleetSnapshot &s = snapshot.read_buffer();
+	    boost::mutex::scoped_lock lock(fleet_mutex);
+	    if (s.version != fleet_version || s.resets != reset_count)
+	    {
+		ROS_DEBUG("Dropping a stale snapshot");
+		return;
+	    }
+	    // a resumed calibration has already been checked against
+	    // the data, so there is nothing to wait for
+	    if (s.resumed && num_delays < NUM_FRAME_DELAYS)
+		num_delays = NUM_FRAME_DELAYS;
+	    int nt = 0;
+	    bool estimates = (num_delays >= NUM_FRAME_DELAYS);
+	    if (estimates)
+	    {
+		tf_batch.resize(nr);
+		if (num_delays < NUM_EKF_INITS+NUM_FRAME_DELAYS)
+		    process_robots(s, 1);
+		else
+		    process_robots(s, operating_condition);
+		if (publish_fleet)
+		    send_fleet_pose(s);
+		nt = nr;
+	    }
+	    num_delays++;
+	    if (s.stamp >= static_stamp)
+	    {
+		tf_batch.resize(nt+cal_frames.size());
+		batch_frames(s, nt);
+		nt += (int) cal_frames.size();
+	    }
+	    tf_batch.resize(nt);
+	    if (nt > 0)
+		br.sendTransform(tf_batch);
+	    // how long did it take from the kinect to here?
+	    if (estimates)
+	    {
+		latency_msg.data = (ros::Time::now()-s.frame_stamp).toSec();
+		latency_pub.publish(latency_msg);
+	    }
 	    return;
 	}
     
@@ -326,7 +1108,6 @@ public:
     puppeteer_msgs::Robots calibrate_routine(void)
 	{
 	    ROS_DEBUG("calibration_routine triggered");
-	    static Eigen::MatrixXd cal_eig(nr,3);
 	    puppeteer_msgs::Robots sorted_bots;
 	    sorted_bots.robots.resize(nr);
 		
@@ -336,28 +1117,15 @@ public:
 	    {
 		ROS_DEBUG_THROTTLE(1,"Calibrating...");
 		puppeteer_msgs::Robots r;
-		double tmp;
 		r.robots.resize(nr);
-		robot_start_ori.clear();
 		for (int j=0; j<nr; j++)
 		{
-		    std::stringstream ss;
-		    ss << "/robot_" << j+1 << "/robot_x0";
-		    ros::param::get(ss.str(), tmp);
-		    ss.str(""); ss.clear();
-		    r.robots[j].point.x = tmp;
-		    ss << "/robot_" << j+1 << "/robot_y0";
-		    ros::param::get(ss.str(), tmp);
-		    ss.str(""); ss.clear();
-		    r.robots[j].point.y = tmp;
-		    ss << "/robot_" << j+1 << "/robot_z0";
-		    ros::param::get(ss.str(), tmp);
-		    ss.str(""); ss.clear();
-		    r.robots[j].point.z = tmp;
-
-		    ss << "/robot_" << j+1 << "/robot_th0";
-		    ros::param::get(ss.str(), tmp);
-		    robot_start_ori.push_back(tmp);
+		    // the controllers may have changed the start pose
+		    // since the robot was registered:
+		    load_robot_params(j);
+		    r.robots[j].point.x = fleet[j].start(0);
+		    r.robots[j].point.y = fleet[j].start(1);
+		    r.robots[j].point.z = fleet[j].start(2);
 		}
 
 		start_bots = r;
@@ -365,83 +1133,690 @@ public:
 		// increment counter, and initialize transform values
 		calibrate_count++;
 		cal_pos << 0, 0, 0;
-		for(int i=0; i<cal_eig.rows(); i++) {
-		    cal_eig(i,0) = 0; cal_eig(i,1) = 0; cal_eig(i,2) = 0; }
+		cal_rot.setIdentity();
+		cal_eig.setZero(3,nr);
+		cal_m2.setZero(3,nr);
+		cal_n.setZero(nr);
+		cal_rejects = 0;
+		ros::param::set("~calibration_failed", false);
+		if (identify_robots)
+		    start_identification();
 		return sorted_bots;
 	    }
+
+	    // find out which robot is which before we start:
+	    if (ident_phase != IDENT_OFF && ident_phase != IDENT_DONE)
+	    {
+		identify_step();
+		return sorted_bots;
+	    }
+
 	    // we are in the process of calibrating:
-	    else if (calibrate_count <= NUM_CALIBRATES)
+	    ROS_DEBUG("adding calibration frame %u", calibrate_count);
+	    if (ident_phase == IDENT_DONE)
 	    {
-		ROS_DEBUG("summing the data");
-		sorted_bots = sort_bots_with_order(&current_bots);
-		Eigen::Matrix<double, Eigen::Dynamic, 3> sorted_eig;
-		bots_to_eigen(&sorted_eig, &sorted_bots);
-		// now we have the sorted matrix... let's keep on
-		// adding the values:
-		cal_eig += sorted_eig;
-		calibrate_count++;
+		if (!sort_bots_by_position(sorted_bots))
+		{
+		    ROS_WARN_THROTTLE(1, "Two robots are nearest to the same "
+				      "point; skipping the frame");
+		    return sorted_bots;
+		}
 	    }
-	    // we are ready to find the transformation:
 	    else
+		sorted_bots = sort_bots_with_order(&current_bots);
+	    Eigen::Matrix3Xd sorted_eig;
+	    bots_to_eigen(&sorted_eig, &sorted_bots);
+	    add_calibration_frame(sorted_eig);
+	    calibrate_count++;
+
+	    // are we there yet?
+	    Eigen::Vector3d ci;
+	    bool done = calibration_interval(ci);
+	    if (!done)
 	    {
-		ROS_DEBUG("Getting transforms");
-		cal_eig /= (double) NUM_CALIBRATES; // average all vectors
+		// give up, and stop everything until we are told to
+		// run again; ~calibration_failed says why we stopped
+		if ((int) calibrate_count > cal_max_frames)
+		{
+		    ROS_ERROR("Calibration failed: after %d frames the "
+			      "offset is only known to within %f, %f, %f m "
+			      "(%u points rejected); stopping",
+			      cal_max_frames, ci(0), ci(1), ci(2),
+			      cal_rejects);
+		    cal_failed = true;
+		    calibrate_count = 0;
+		    ros::param::set("~calibration_failed", true);
+		    ros::param::set("/operating_condition", 3);
+		}
+		return sorted_bots;
+	    }
+
+	    // we are ready to find the transformation:
+	    ROS_DEBUG("Getting transforms");
 		
-		// get transform for each robot:
-		sorted_bots = sort_bots_with_order(&current_bots);
-		Eigen::Matrix<double, Eigen::Dynamic, 3> temp_eig;
-		bots_to_eigen(&temp_eig, &start_bots);
-		cal_eig = temp_eig-cal_eig;
+	    // fit the start positions onto the mean positions:
+	    Eigen::Matrix3Xd temp_eig;
+	    bots_to_eigen(&temp_eig, &start_bots);
+	    fit_calibration(temp_eig, cal_eig);
+
+	    ROS_INFO("Calibrated in %u frames to within %f, %f, %f m "
+		     "(%u points rejected)", calibrate_count-1,
+		     ci(0), ci(1), ci(2), cal_rejects);
+	    ROS_DEBUG("calibration pose: %f, %f, %f",
+		      cal_pos(0),cal_pos(1),cal_pos(2));
+
+	    compose_calibration();
+	    reset_tracks(sorted_bots);
+	    calibrated_flag = true;
+	    calibrate_count = 0;
+	    save_state();
+	    return sorted_bots;
+	}
+
+
+    // the frames that batch_frames publishes are fixed once we are
+    // calibrated, so compose them once to take points straight from
+    // /optimization_frame to /map
+    void compose_calibration(void)
+	{
+	    Eigen::Quaterniond q;
+	    tf::quaternionTFToEigen(map_rotation, q);
+	    Eigen::Affine3d oo_opt(cal_rot);
+	    oo_opt.pretranslate(cal_pos);
+	    Eigen::Affine3d oo_map(
+		Eigen::Translation3d(cal_pos(0), 0, cal_pos(2))*
+		cal_rot*q.normalized());
+	    opt_from_oo = oo_opt.inverse(Eigen::Isometry);
+	    map_from_opt = oo_map.inverse(Eigen::Isometry)*oo_opt;
+	    tf::TransformEigenToTF(oo_opt, opt_pose);
+	    tf::TransformEigenToTF(oo_map, map_pose);
+	    return;
+	}
 
-		// Now find the mean of the transforms:
-		for (int i=0; i<nr; i++)
-		    cal_pos += cal_eig.block<1,3>(i,0);
-		cal_pos /= nr;
-		cal_pos = -1.0*cal_pos;
 
-		ROS_DEBUG("calibration pose: %f, %f, %f",
-			  cal_pos(0),cal_pos(1),cal_pos(2));
-		calibrated_flag = true;
+    // instead of calibrating, see if the robots are where the saved
+    // state says they should be: either where their tracks were
+    // left, or at their calibrated start positions.  Once
+    // RESUME_CHECK_FRAMES frames in a row agree, we are calibrated;
+    // the first one that doesn't sends us back to calibrate_routine.
+    puppeteer_msgs::Robots check_saved_state(void)
+	{
+	    puppeteer_msgs::Robots sorted_bots;
+	    sorted_bots.robots.resize(nr);
+	    if (!match_saved_state(false) && !match_saved_state(true))
+	    {
+		ROS_INFO("The robots are not where the saved state puts "
+			 "them; calibrating");
+		resume_pending = false;
 		calibrate_count = 0;
+		return calibrate_routine();
 	    }
+
+	    // follow the robots from frame to frame while we check:
+	    sorted_bots.header = current_bots.header;
+	    sorted_bots.number = nr;
+	    for (int j=0; j<nr; j++)
+	    {
+		sorted_bots.robots[j] = current_bots.robots[resume_match[j]];
+		fleet[j].track.pos = det_eig.col(resume_match[j]);
+	    }
+	    if (++resume_count < RESUME_CHECK_FRAMES)
+		return sorted_bots;
+
+	    ROS_INFO("Resumed from the saved calibration in %d frames",
+		     resume_count);
+	    compose_calibration();
+	    reset_tracks(sorted_bots);
+	    resume_pending = false;
+	    resumed = true;
+	    calibrated_flag = true;
 	    return sorted_bots;
 	}
 
-    // now that we are calibrated, we are free to send the transforms:
-    void send_frames(void)
+
+    // match each robot to the nearest point in det_eig, either from
+    // its track position or from its calibrated start position.
+    // Every robot needs a point within search_radius that no other
+    // robot wants.  Fills resume_match.
+    bool match_saved_state(bool from_start)
+	{
+	    int nd = (int) det_eig.cols();
+	    resume_match.assign(nr, -1);
+	    for (int j=0; j<nr; j++)
+	    {
+		Eigen::Vector3d p = fleet[j].track.pos;
+		if (from_start)
+		    p = cal_rot*fleet[j].start+cal_pos;
+		double best = search_radius;
+		for (int i=0; i<nd; i++)
+		{
+		    Eigen::Vector3d d = det_eig.col(i)-p;
+		    double dist = hypot(d(0), d(2));
+		    if (dist < best)
+		    {
+			best = dist;
+			resume_match[j] = i;
+		    }
+		}
+		if (resume_match[j] < 0)
+		    return false;
+		for (int k=0; k<j; k++)
+		    if (resume_match[k] == resume_match[j])
+			return false;
+	    }
+	    return true;
+	}
+
+
+    // hand the calibration, the robot ordering and the track
+    // positions to the saving thread to be written to state_file
+    void save_state(void)
+	{
+	    last_save = tstamp;
+	    if (state_file.empty() || !calibrated_flag ||
+		(int) ref_ord.size() != nr)
+		return;
+	    SavedState &s = saved.write_buffer();
+	    s.rot = cal_rot;
+	    s.pos = cal_pos;
+	    s.ord = ref_ord;
+	    s.ids.resize(nr);
+	    s.start.resize(3, nr);
+	    s.tracks.resize(3, nr);
+	    for (int j=0; j<nr; j++)
+	    {
+		s.ids[j] = fleet[j].id;
+		s.start.col(j) = fleet[j].start;
+		s.tracks.col(j) = fleet[j].track.pos;
+	    }
+	    saved.publish();
+	    save_queue.addCallback(save_call);
+	    return;
+	}
+
+
+    // write the newest state from save_state.  It is written to a
+    // temporary file first, so that a crash never leaves half of one
+    // behind.  This runs on the saving thread.
+    void write_state(void)
+	{
+	    if (!saved.update())
+		return;
+	    const SavedState &s = saved.read_buffer();
+	    int num = (int) s.ids.size();
+	    std::string tmp = state_file+".tmp";
+	    FILE *fp = fopen(tmp.c_str(), "wb");
+	    if (fp == NULL)
+	    {
+		ROS_WARN_THROTTLE(60, "Cannot write %s", tmp.c_str());
+		return;
+	    }
+	    uint32_t head[3] = {STATE_MAGIC, STATE_VERSION, (uint32_t) num};
+	    bool ok = (fwrite(head, sizeof(head), 1, fp) == 1);
+	    ok = ok && fwrite(s.rot.data(), sizeof(double), 9, fp) == 9;
+	    ok = ok && fwrite(s.pos.data(), sizeof(double), 3, fp) == 3;
+	    for (int j=0; ok && j<num; j++)
+	    {
+		int32_t ids[2] = {s.ids[j], s.ord[j]};
+		ok = fwrite(ids, sizeof(ids), 1, fp) == 1 &&
+		    fwrite(s.start.col(j).data(), sizeof(double), 3, fp) == 3 &&
+		    fwrite(s.tracks.col(j).data(), sizeof(double), 3, fp) == 3;
+	    }
+	    ok = (fclose(fp) == 0) && ok;
+	    if (!ok || rename(tmp.c_str(), state_file.c_str()) != 0)
+		ROS_WARN_THROTTLE(60, "Cannot save the state to %s",
+				  state_file.c_str());
+	    return;
+	}
+
+
+    // read state_file back in.  It is only used if it was saved for
+    // the same robots with the same start poses; returns true if it
+    // was.
+    bool load_state(void)
+	{
+	    if (state_file.empty())
+		return false;
+	    FILE *fp = fopen(state_file.c_str(), "rb");
+	    if (fp == NULL)
+		return false;
+	    uint32_t head[3];
+	    Eigen::Matrix3d rot;
+	    Eigen::Vector3d pos;
+	    std::vector<int> ord(nr);
+	    Eigen::Matrix3Xd tracks(3, nr);
+	    bool ok = (fread(head, sizeof(head), 1, fp) == 1) &&
+		head[0] == STATE_MAGIC && head[1] == STATE_VERSION &&
+		(int) head[2] == nr;
+	    ok = ok && fread(rot.data(), sizeof(double), 9, fp) == 9;
+	    ok = ok && fread(pos.data(), sizeof(double), 3, fp) == 3;
+	    for (int j=0; ok && j<nr; j++)
+	    {
+		int32_t ids[2];
+		Eigen::Vector3d start;
+		ok = fread(ids, sizeof(ids), 1, fp) == 1 &&
+		    fread(start.data(), sizeof(double), 3, fp) == 3 &&
+		    fread(tracks.col(j).data(), sizeof(double), 3, fp) == 3;
+		ok = ok && ids[0] == fleet[j].id &&
+		    ids[1] >= 1 && ids[1] <= nr &&
+		    (start-fleet[j].start).cwiseAbs().maxCoeff() <
+		    STATE_START_TOL;
+		if (ok)
+		    ord[j] = ids[1];
+	    }
+	    fclose(fp);
+	    if (!ok)
+	    {
+		ROS_INFO("Ignoring the saved state in %s; it is for a "
+			 "different fleet", state_file.c_str());
+		return false;
+	    }
+
+	    ROS_INFO("Loaded the saved state from %s", state_file.c_str());
+	    cal_rot = rot;
+	    cal_pos = pos;
+	    ref_ord = ord;
+	    for (int j=0; j<nr; j++)
+		fleet[j].track.pos = tracks.col(j);
+	    return true;
+	}
+
+
+    // find the rotation and translation that best take the start
+    // positions onto the mean positions the kinect saw the robots
+    // at, in the least squares sense (Kabsch).  The rotation is
+    // only defined when the start positions are spread out in more
+    // than one direction; otherwise only the translation is found,
+    // like it used to be.  The residual of each robot is reported.
+    void fit_calibration(const Eigen::Matrix3Xd &start,
+			 const Eigen::Matrix3Xd &obs)
+	{
+	    Eigen::Vector3d smean = start.rowwise().mean();
+	    Eigen::Vector3d omean = obs.rowwise().mean();
+	    Eigen::Matrix3d spread = Eigen::Matrix3d::Zero();
+	    Eigen::Matrix3d h = Eigen::Matrix3d::Zero();
+	    for (int j=0; j<nr; j++)
+	    {
+		Eigen::Vector3d ds = start.col(j)-smean;
+		spread += ds*ds.transpose();
+		h += ds*(obs.col(j)-omean).transpose();
+	    }
+
+	    Eigen::JacobiSVD<Eigen::Matrix3d> spread_svd(spread);
+	    if (nr >= 3 && spread_svd.singularValues()(1) >=
+		nr*CAL_MIN_SPREAD*CAL_MIN_SPREAD)
+	    {
+		Eigen::JacobiSVD<Eigen::Matrix3d> svd(
+		    h, Eigen::ComputeFullU | Eigen::ComputeFullV);
+		// don't let it turn into a reflection:
+		Eigen::Vector3d d(1, 1, 1);
+		if ((svd.matrixV()*svd.matrixU().transpose()).
+		    determinant() < 0)
+		    d(2) = -1;
+		cal_rot = svd.matrixV()*d.asDiagonal()*
+		    svd.matrixU().transpose();
+	    }
+	    else
+	    {
+		ROS_WARN("Start positions are too close to a line to "
+			 "find the kinect's rotation; only finding its "
+			 "offset");
+		cal_rot.setIdentity();
+	    }
+	    cal_pos = omean-cal_rot*smean;
+
+	    Eigen::AngleAxisd aa(cal_rot);
+	    ROS_INFO("Calibration rotation: %f degrees about %f, %f, %f",
+		     aa.angle()*180.0/M_PI,
+		     aa.axis()(0), aa.axis()(1), aa.axis()(2));
+	    for (int j=0; j<nr; j++)
+	    {
+		double res = (cal_rot*start.col(j)+cal_pos-obs.col(j)).norm();
+		if (res > CAL_MAX_RESIDUAL)
+		    ROS_WARN("Robot %d is %f m from where the calibration "
+			     "puts it; check its start pose",
+			     fleet[j].id, res);
+		else
+		    ROS_INFO("Robot %d calibration residual: %f m",
+			     fleet[j].id, res);
+	    }
+	    return;
+	}
+
+
+    // add one sorted frame to the running mean and variance of each
+    // robot's position.  Once a robot has a few points, any point
+    // that is too far from its mean is rejected.
+    void add_calibration_frame(const Eigen::Matrix3Xd &pts)
+	{
+	    for (int j=0; j<nr; j++)
+	    {
+		const Eigen::Vector3d x = pts.col(j);
+		if (cal_n(j) >= CAL_OUTLIER_FRAMES)
+		{
+		    Eigen::Vector3d sd = (cal_m2.col(j)/(cal_n(j)-1)).
+			cwiseSqrt().cwiseMax(CAL_MIN_STD);
+		    if (((x-cal_eig.col(j)).cwiseAbs().array() >
+			 CAL_OUTLIER_SIGMA*sd.array()).any())
+		    {
+			cal_rejects++;
+			continue;
+		    }
+		}
+		cal_n(j)++;
+		Eigen::Vector3d delta = x-cal_eig.col(j);
+		cal_eig.col(j) += delta/cal_n(j);
+		cal_m2.col(j) += delta.cwiseProduct(x-cal_eig.col(j));
+	    }
+	    return;
+	}
+
+
+    // find the half width of the confidence interval on each
+    // component of cal_pos, which is the mean over the robots of
+    // their mean offsets.  Returns true once every robot has enough
+    // points and the interval is inside of the tolerance.
+    bool calibration_interval(Eigen::Vector3d &ci)
+	{
+	    Eigen::Vector3d var = Eigen::Vector3d::Zero();
+	    bool enough = true;
+	    for (int j=0; j<nr; j++)
+	    {
+		if (cal_n(j) < MIN_CALIBRATES)
+		{
+		    enough = false;
+		    continue;
+		}
+		var += cal_m2.col(j)/((double) (cal_n(j)-1)*cal_n(j));
+	    }
+	    ci = CAL_CONFIDENCE_Z*var.cwiseSqrt()/std::max(nr, 1);
+	    if (!enough)
+		ci.setConstant(std::numeric_limits<double>::infinity());
+	    return enough && ci.maxCoeff() <= cal_tol;
+	}
+
+    // now that we are calibrated, we are free to send the transforms.
+    // They are copied into tf_batch starting at k0, and are stamped
+    // ahead by STATIC_FRAME_PERIOD like the static transform
+    // publisher does, so that they stay valid until the next ones go
+    // out.
+    void batch_frames(const FleetSnapshot &s, int k0)
+	{
+	    ROS_DEBUG("Batching frames");
+	    cal_frames[0].setData(s.opt_pose);
+	    
+	    // Publish /map frame based on robot calibration
+	    cal_frames[1].setData(s.map_pose);
+	    
+	    // and the odometry frame stays put under /map
+	    static_stamp = s.stamp+ros::Duration(STATIC_FRAME_PERIOD);
+	    for (unsigned int k=0; k<cal_frames.size(); k++)
+	    {
+		cal_frames[k].stamp_ = static_stamp;
+		tf::transformStampedTFToMsg(cal_frames[k], tf_batch[k0+k]);
+	    }
+	    return;
+	}
+   
+
+    // Identification drives the robots in a pattern that tells them
+    // apart, so that they don't have to be ordered by their start x
+    // positions.  Robot j gets the code j+1, and for each bit of the
+    // codes, every robot with that bit set drives forward a few
+    // centimeters and back, all at the same time.  The points that
+    // moved get that bit, and the robots are then known by their
+    // codes after ident_bits motions instead of one per robot.  The
+    // robots must stay far enough apart that each point can be
+    // followed from frame to frame; if they don't, or a point only
+    // moves part of the way, the motions are tried again.
+    void start_identification(void)
+	{
+	    for (int j=0; j<nr; j++)
+		if (fleet[j].index < 0)
+		{
+		    ROS_WARN("Robot %d has no robot_index; using the start "
+			     "x ordering instead of identifying it",
+			     fleet[j].id);
+		    ident_phase = IDENT_OFF;
+		    return;
+		}
+	    ident_bits = 0;
+	    while ((1 << ident_bits) <= nr)
+		ident_bits++;
+	    ident_tries = 0;
+	    restart_identification();
+	    return;
+	}
+
+
+    void restart_identification(void)
+	{
+	    ident_phase = IDENT_SETTLE;
+	    ident_start = tstamp;
+	    ident_bit = 0;
+	    ident_codes.assign(nr, 0);
+	    ident_pos.resize(3, 0);
+	    return;
+	}
+
+
+    // stop any robots that are moving for the identification
+    void stop_identification(void)
+	{
+	    if (ident_phase == IDENT_MOVE || ident_phase == IDENT_RETURN)
+		for (int j=0; j<nr; j++)
+		    send_speed(j, 0.0);
+	    ident_phase = IDENT_OFF;
+	    return;
+	}
+
+
+    // the identification didn't work this time; try it again from
+    // the start, or give up and use the x ordering
+    void retry_identification(const char *why)
+	{
+	    for (int j=0; j<nr; j++)
+		send_speed(j, 0.0);
+	    if (++ident_tries >= IDENT_MAX_TRIES)
+	    {
+		ROS_ERROR("Could not identify the robots (%s); using the "
+			  "start x ordering", why);
+		ident_phase = IDENT_OFF;
+		return;
+	    }
+	    ROS_WARN("Identifying the robots again: %s", why);
+	    restart_identification();
+	    return;
+	}
+
+
+    // run one frame of the identification
+    void identify_step(void)
+	{
+	    if (!follow_points())
+	    {
+		retry_identification("lost track of a robot");
+		return;
+	    }
+	    double t = (tstamp-ident_start).toSec();
+	    switch (ident_phase)
+	    {
+	    case IDENT_SETTLE:
+		if (t < IDENT_SETTLE_TIME)
+		    return;
+		if (ident_bit == ident_bits)
+		{
+		    finish_identification();
+		    return;
+		}
+		ident_rest = ident_pos;
+		send_bit(IDENT_SPEED);
+		ident_phase = IDENT_MOVE;
+		break;
+	    case IDENT_MOVE:
+		if (t < IDENT_MOVE_TIME)
+		    return;
+		send_bit(0.0);
+		ident_phase = IDENT_MEASURE;
+		break;
+	    case IDENT_MEASURE:
+		if (t < IDENT_SETTLE_TIME)
+		    return;
+		for (int k=0; k<nr; k++)
+		{
+		    Eigen::Vector3d d = ident_pos.col(k)-ident_rest.col(k);
+		    double dist = hypot(d(0), d(2));
+		    if (dist > IDENT_MOVE_MIN)
+			ident_codes[k] |= 1 << ident_bit;
+		    else if (dist > IDENT_STILL_MAX)
+		    {
+			retry_identification("a robot barely moved");
+			return;
+		    }
+		}
+		send_bit(-IDENT_SPEED);
+		ident_phase = IDENT_RETURN;
+		break;
+	    case IDENT_RETURN:
+		if (t < IDENT_MOVE_TIME)
+		    return;
+		send_bit(0.0);
+		ident_bit++;
+		ident_phase = IDENT_SETTLE;
+		break;
+	    default:
+		return;
+	    }
+	    ident_start = tstamp;
+	    return;
+	}
+
+
+    // match the points in det_eig to the ones in ident_pos.  The
+    // robots move much less than their size between frames, so the
+    // nearest point is the same robot; returns false if two points
+    // want the same one.
+    bool follow_points(void)
+	{
+	    if (ident_pos.cols() == 0)
+	    {
+		ident_pos = det_eig;
+		return true;
+	    }
+	    ident_match.assign(nr, -1);
+	    for (int k=0; k<nr; k++)
+	    {
+		double best = search_radius;
+		for (int i=0; i<nr; i++)
+		{
+		    Eigen::Vector3d d = det_eig.col(i)-ident_pos.col(k);
+		    double dist = hypot(d(0), d(2));
+		    if (dist < best)
+		    {
+			best = dist;
+			ident_match[k] = i;
+		    }
+		}
+		if (ident_match[k] < 0)
+		    return false;
+		for (int m=0; m<k; m++)
+		    if (ident_match[m] == ident_match[k])
+			return false;
+	    }
+	    for (int k=0; k<nr; k++)
+		ident_pos.col(k) = det_eig.col(ident_match[k]);
+	    return true;
+	}
+
+
+    // every point should now have the code of exactly one robot
+    void finish_identification(void)
+	{
+	    ident_ref.resize(3, nr);
+	    std::vector<bool> seen(nr, false);
+	    for (int k=0; k<nr; k++)
+	    {
+		int j = ident_codes[k]-1;
+		if (j < 0 || j >= nr || seen[j])
+		{
+		    retry_identification("the motions did not match the "
+					 "robots");
+		    return;
+		}
+		seen[j] = true;
+		ident_ref.col(j) = ident_pos.col(k);
+	    }
+	    ROS_INFO("Identified %d robots with %d motions", nr, ident_bits);
+	    ident_phase = IDENT_DONE;
+	    return;
+	}
+
+
+    // drive every robot whose code has the current bit set
+    void send_bit(double v)
 	{
-	    ROS_DEBUG("Sending frames");
-	    tf::Transform transform;
+	    for (int j=0; j<nr; j++)
+		if ((j+1) & (1 << ident_bit))
+		    send_speed(j, v);
+	    return;
+	}
 
-	    transform.setOrigin(tf::Vector3(cal_pos(0),
-					    cal_pos(1),
-					    cal_pos(2)));
-	    transform.setRotation(tf::Quaternion(0,0,0,1));
-	    br.sendTransform(tf::StampedTransform(transform, tstamp,
-						  "/oriented_optimization_frame",
-						  "/optimization_frame"));
 
-	    
-	    // Publish /map frame based on robot calibration
-	    transform.setOrigin(tf::Vector3(cal_pos(0),
-					    0,
-					    cal_pos(2)));
-	    transform.setRotation(tf::Quaternion(.707107,0.0,0.0,-0.707107));
-	    br.sendTransform(tf::StampedTransform(transform, tstamp,
-						  "/oriented_optimization_frame",
-						  "/map"));
-	    
-	    // publish one more frame that is the frame the robot
-	    // calculates its odometry in.
-	    transform.setOrigin(tf::Vector3(0,0,0));
-	    transform.setRotation(tf::Quaternion(1,0,0,0));
-	    br.sendTransform(tf::StampedTransform(transform, tstamp,
-						  "/map",
-						  "/robot_odom_pov"));
-	    ROS_DEBUG("frames sent");
+    // drive robot j straight at v, or stop it if v is zero.  The
+    // command goes out from speed_sender's thread, so this never
+    // waits on the serial node.
+    void send_speed(int j, double v)
+	{
+	    puppeteer_msgs::speed_command::Request req;
+	    req.robot_index = fleet[j].index;
+	    req.type = (v == 0.0 ? 'h' : 'd');
+	    req.Vleft = v;
+	    req.Vright = 0.0;
+	    req.Vtop = 0.0;
+	    req.div = (v == 0.0 ? 3 : 4);
+	    speed_sender.send(req);
 	    return;
 	}
-   
+
+
+    // sort a frame into s by matching each robot to the point
+    // nearest to where it was identified, which then follows it.
+    // Returns false, and leaves the points where they were, if two
+    // robots want the same point.
+    bool sort_bots_by_position(puppeteer_msgs::Robots &s)
+	{
+	    int nd = (int) det_eig.cols();
+	    std::vector<int> match(nr, -1);
+	    std::vector<bool> taken(nd, false);
+	    for (int j=0; j<nr; j++)
+	    {
+		double best_dist = std::numeric_limits<double>::max();
+		for (int i=0; i<nd; i++)
+		{
+		    Eigen::Vector3d d = det_eig.col(i)-ident_ref.col(j);
+		    double dist = hypot(d(0), d(2));
+		    if (dist < best_dist)
+		    {
+			best_dist = dist;
+			match[j] = i;
+		    }
+		}
+		if (match[j] < 0 || taken[match[j]])
+		    return false;
+		taken[match[j]] = true;
+	    }
+
+	    s.header = current_bots.header;
+	    s.number = nr;
+	    s.robots.resize(nr);
+	    for (int j=0; j<nr; j++)
+	    {
+		s.robots[j] = current_bots.robots[match[j]];
+		ident_ref.col(j) = det_eig.col(match[j]);
+	    }
+	    return true;
+	}
+
 
     // return a Robots type that has the robots[] field sorted
     // according to the "order" variable
@@ -497,27 +1872,42 @@ public:
 	}
 
     
-    // convert a Robots message to an Eigen matrix
-    void bots_to_eigen(Eigen::Matrix<double, Eigen::Dynamic, 3> *e,
-		       puppeteer_msgs::Robots *r)
+    // convert a Robots message to an Eigen matrix with one column
+    // per point
+    void bots_to_eigen(Eigen::Matrix3Xd *e, const puppeteer_msgs::Robots *r)
 	{
 	    // first we size the matrix:
 	    int num = (int) r->robots.size();
-	    e->resize(num, Eigen::NoChange);
+	    e->resize(Eigen::NoChange, num);
 	    
-	    ROS_DEBUG("Conversion to Eigen detected %d robots",num);
+	    if (!over_budget)
+		ROS_DEBUG("Conversion to Eigen detected %d robots",num);
 	    // now we can fill in the info:
-	    int j=0;
-	    for (j=0; j<num; j++)
+	    for (int j=0; j<num; j++)
 	    {
-		(*e)(j,0) = r->robots[j].point.x;
-		(*e)(j,1) = r->robots[j].point.y;
-		(*e)(j,2) = r->robots[j].point.z;
+		(*e)(0,j) = r->robots[j].point.x;
+		(*e)(1,j) = r->robots[j].point.y;
+		(*e)(2,j) = r->robots[j].point.z;
 	    }
 
 	    return;
 	}
 
+    // and copy the columns of an Eigen matrix back into a Robots
+    // message of the same size
+    template <typename Derived>
+    void eigen_to_bots(const Eigen::MatrixBase<Derived> &e,
+		       puppeteer_msgs::Robots *r)
+	{
+	    for (int j=0; j<(int) e.cols(); j++)
+	    {
+		r->robots[j].point.x = e(0,j);
+		r->robots[j].point.y = e(1,j);
+		r->robots[j].point.z = e(2,j);
+	    }
+	    return;
+	}
+
     
     bool generate_order(void)
 	{
@@ -527,20 +1917,15 @@ public:
 	    // highest x-value (in /oriented_optimization_frame) to
 	    // the lowest
 	    std::vector<double> pos;
-	    double tmp;
 	    ref_ord.clear();
 	    for (int j=0; j<nr; j++)
 	    {
-		std::stringstream ss;
-		ss << "/robot_" << j+1 << "/robot_x0";
-		if (ros::param::has(ss.str()))
-		    ros::param::get(ss.str(), tmp);
-		else {
+		if (!load_robot_params(j)) {
 		    ROS_WARN_THROTTLE(1, "Cannot determine ordering!");
 		    return true;
 		}
 
-		pos.push_back(tmp);		    
+		pos.push_back(fleet[j].start(0));
 		ref_ord.push_back(j+1);
 	    }
 
@@ -567,94 +1952,614 @@ public:
 	    return false;
 	}
 
-    // This function takes references to two Robot messages, a current
-    // and a last.  It sorts the data such that the returned Robots
-    // message has the same data as the current message, but it is
-    // sorted according to the last message order.
-    puppeteer_msgs::Robots associate_robots(
-	puppeteer_msgs::Robots c,
-	puppeteer_msgs::Robots l)
+    // This function takes the current Robots message, and sorts its
+    // data into current_bots_sorted according to the robot tracks.
+    // The points in c must be the ones that were corrected into
+    // det_eig by adjust_for_robot_size.  Each track is first
+    // predicted forward by dt, and only points that are inside of
+    // the Mahalanobis gate of a track's predicted position are
+    // considered for that track.  Each group of tracks that share
+    // candidate points is solved on its own.  Lost tracks then
+    // compete for any leftover points, and whatever is still left
+    // over is treated as clutter.  Tracks without a point keep their
+    // predicted position.  Everything is done in the scratch members,
+    // so this does not allocate once their sizes have settled.
+    void associate_robots(const puppeteer_msgs::Robots &c, double dt)
 	{
-	    ROS_DEBUG("Attempting data association problem");
-	    puppeteer_msgs::Robots s;
+	    if (!over_budget)
+		ROS_DEBUG("Attempting data association problem");
+	    // the last sorted frame becomes the previous one:
+	    prev_bots_sorted.header = current_bots_sorted.header;
+	    prev_bots_sorted.robots.swap(current_bots_sorted.robots);
+	    puppeteer_msgs::Robots &s = current_bots_sorted;
 	    s.robots.resize(nr);
 
-	    ROS_DEBUG("Filling in missing points");
-	    // first let's fill in the current Robots message that may
-	    // be missing data
-	    double def = DEFAULT_ERR;
-	    geometry_msgs::PointStamped err_pt;
-	    err_pt.header = c.robots[0].header;
-	    err_pt.point.x = def;
-	    err_pt.point.y = def;
-	    err_pt.point.z = def;
-	    for (int i=0; i<(nr- (int) c.robots.size()); i++)
-		c.robots.push_back(err_pt);
-
-	    // now for each permutation, we can calculate a norm:
-	    Eigen::Matrix<double, Eigen::Dynamic, 3> bot_eig, clust_eig;
-	    ROS_DEBUG("Converting bots to eig");
-	    bots_to_eigen(&bot_eig, &l);
-	    bots_to_eigen(&clust_eig, &c);
-	    Eigen::VectorXd dist(height);
-	    double err = 0;
-	    ROS_DEBUG("Testing all permutations");
-	    for (int i=0; i<height; i++)
-	    {
-		err = 0;
-		for (int j=0; j<nr; j++)
+	    gate_eig.resize(nr);
+	    track_eig.resize(3, nr);
+	    sinv_eig.resize(3, nr);
+	    if (!over_budget)
+		ROS_DEBUG("Predicting tracks");
+	    for (int i=0; i<nr; i++)
+	    {
+		predict_track(i, dt);
+		track_eig.col(i) = fleet[i].track.pos;
+		gate_eig(i) = track_gate(i);
+		Eigen::Matrix2d Si = track_innovation(i).inverse();
+		sinv_eig.col(i) << Si(0,0), Si(0,1), Si(1,1);
+	    }
+	    const PointsMap &clust_eig = det_eig;
+	    int nc = (int) clust_eig.cols();
+
+	    if (!over_budget)
+		ROS_DEBUG("Gating candidate points");
+	    // find every track/point pair inside of the gate.  Small
+	    // problems get the full distance matrix in one pass, and
+	    // big ones only look at nearby grid cells.  Either way the
+	    // pairs come out ordered by track:
+	    pairs.clear();
+	    pair_cost.clear();
+	    pair_start.assign(nr+1, 0);
+	    if (nr*nc <= DENSE_PAIR_LIMIT)
+	    {
+		track_distances();
+		for (int i=0; i<nr; i++)
+		{
+		    pair_start[i] = (int) pairs.size();
+		    if (gate_eig(i) <= 0)
+			continue;
+		    for (int j=0; j<nc; j++)
+		    {
+			if (dist_eig(i,j) <= GATE_CHI2)
+			{
+			    pairs.push_back(std::make_pair(i,j));
+			    pair_cost.push_back(dist_eig(i,j));
+			}
+		    }
+		}
+	    }
+	    else
+	    {
+		find_gated_pairs(track_eig, gate_eig, clust_eig, search_radius,
+				 grid_cells, near_pairs);
+		int last = -1;
+		for (unsigned int k=0; k<near_pairs.size(); k++)
+		{
+		    int i = near_pairs[k].first;
+		    double d = track_distance(i, clust_eig.col(near_pairs[k].second));
+		    if (d > GATE_CHI2)
+			continue;
+		    while (last < i)
+			pair_start[++last] = (int) pairs.size();
+		    pairs.push_back(near_pairs[k]);
+		    pair_cost.push_back(d);
+		}
+		while (last < nr-1)
+		    pair_start[++last] = (int) pairs.size();
+	    }
+	    pair_start[nr] = (int) pairs.size();
+
+	    // in steady state each track just keeps its own nearest
+	    // point, and the full solve is only needed when that is not
+	    // clearly the right answer:
+	    assign_tries++;
+	    if (warm_start_assignment(nc))
+		assign_hits++;
+	    else
+		solve_groups(nc);
+	    if (!over_budget && assign_tries % WARM_REPORT_FRAMES == 0)
+		ROS_DEBUG("Association fast path hit rate: %.1f%% of %u frames",
+			  100.0*assign_hits/assign_tries, assign_tries);
+
+	    // lost tracks can be reacquired from a leftover point near
+	    // where they were lost, preferring the closest ones.  The
+	    // gate starts at search_radius and grows the longer a robot
+	    // has been missing, up to LOST_GATE_MAX.  This can wait if
+	    // the last frame went over budget:
+	    used.assign(nc, 0);
+	    lost_bots.clear();
+	    left_pts.clear();
+	    for (int i=0; i<nr; i++)
+	    {
+		if (assign[i] >= 0)
+		    used[assign[i]] = 1;
+		else if (fleet[i].track.state == TRACK_LOST)
+		    lost_bots.push_back(i);
+	    }
+	    for (int j=0; j<nc; j++)
+		if (!used[j])
+		    left_pts.push_back(j);
+	    if (!over_budget && !lost_bots.empty() && !left_pts.empty())
+	    {
+		int nb = (int) lost_bots.size();
+		int np = (int) left_pts.size();
+		// the fast path may have skipped solve_groups, so
+		// cost_eig may not be big enough yet:
+		ensure_cost_size(nb, np+nb);
+		Eigen::Block<Eigen::MatrixXd> cost =
+		    cost_eig.topLeftCorner(nb, np+nb);
+		cost.setConstant(NO_PAIR_COST);
+		for (int i=0; i<nb; i++)
+		{
+		    double gate = std::min(search_radius+LOST_GATE_GROWTH*
+					   fleet[lost_bots[i]].track.misses,
+					   std::max(search_radius, LOST_GATE_MAX));
+		    cost(i,np+i) = gate;
+		    for (int j=0; j<np; j++)
+		    {
+			double dx = track_eig(0,lost_bots[i])-
+			    clust_eig(0,left_pts[j]);
+			double dz = track_eig(2,lost_bots[i])-
+			    clust_eig(2,left_pts[j]);
+			double d = sqrt(dx*dx+dz*dz);
+			if (d < gate)
+			    cost(i,j) = d;
+		    }
+		}
+		solve_assignment(cost, sub_assign, assign_work);
+		for (int i=0; i<nb; i++)
 		{
-		    Eigen::Vector3d bvec = bot_eig.block<1,3>(j,0);
-		    Eigen::Vector3d cvec = clust_eig.block<1,3>(tab[i][j]-1,0);
-		    err += (bvec-cvec).norm();
+		    if (sub_assign[i] < np &&
+			cost(i,sub_assign[i]) < NO_PAIR_COST)
+		    {
+			assign[lost_bots[i]] = left_pts[sub_assign[i]];
+			used[left_pts[sub_assign[i]]] = 1;
+		    }
 		}
-		dist(i) = err;
 	    }
 
-	    ROS_DEBUG("Finding the minimum");
-	    // now find the entry in dist that has the minimum value:
-	    int key = find_minimum_index(dist);
+	    // anything that is still unused is clutter:
+	    int clutter = (int) std::count(used.begin(), used.end(), 0);
+	    clutter_count += clutter;
+	    if (!over_budget && clutter > 0)
+		ROS_DEBUG("Rejected %d clutter points", clutter);
 
-	    // now, use the mapping defined by key to fill out s:
+	    // now update the tracks and use them to fill out s:
 	    s.header = c.header;
 	    s.number = nr;
 	    for (int i=0; i<nr; i++)
-		s.robots[i] = c.robots[tab[key][i]-1];
-	    // fill in error array:
-	    for (int j=0; j<nr; j++)
 	    {
-		if (s.robots[j].point.x > DEFAULT_ERR-0.1)
-		    bad_array[j] = true;
+		if (assign[i] < 0)
+		{
+		    update_track(i, NULL);
+		    s.robots[i].header = c.header;
+		}
 		else
-		    bad_array[j] = false;
+		{
+		    Eigen::Vector3d meas = clust_eig.col(assign[i]);
+		    update_track(i, &meas);
+		    s.robots[i].header = c.robots[assign[i]].header;
+		}
+		s.robots[i].point.x = fleet[i].track.pos(0);
+		s.robots[i].point.y = fleet[i].track.pos(1);
+		s.robots[i].point.z = fleet[i].track.pos(2);
 	    }
-	    	    
-	    return s;
+
+	    return;
 	}
 
 
-    // This function takes in an Eigen::VectorXd, and returns the
-    // index to its minimum element:
-    int find_minimum_index(Eigen::VectorXd v)
+    // Check whether every track can simply keep the nearest point
+    // in its gate.  If each one is inside a tight gate, clearly
+    // closer than the track's next best option (including going
+    // missing), and not wanted by any other track, then every track
+    // is on its own row minimum, so no other assignment can cost
+    // less and the full solve can be skipped.  Fills assign and
+    // returns true if so.
+    bool warm_start_assignment(int nc)
 	{
-	    std::vector<double> tmp;
-	    // convert VectorXd to a std::vector
-	    for (int i=0; i< (int) v.size(); i++)
-		tmp.push_back(v(i));
-	    return ((int) distance(tmp.begin(),
-				   min_element(tmp.begin(), tmp.end())));
+	    assign.assign(nr, -1);
+	    used.assign(nc, 0);
+	    for (int i=0; i<nr; i++)
+	    {
+		if (fleet[i].track.state == TRACK_LOST)
+		    continue;
+		if (pair_start[i] == pair_start[i+1])
+		    return false;
+		int best = pair_start[i];
+		double d1 = pair_cost[best], d2 = GATE_CHI2;
+		for (int k=pair_start[i]+1; k<pair_start[i+1]; k++)
+		{
+		    if (pair_cost[k] < d1)
+		    {
+			d2 = d1;
+			d1 = pair_cost[k];
+			best = k;
+		    }
+		    else if (pair_cost[k] < d2)
+			d2 = pair_cost[k];
+		}
+		int j = pairs[best].second;
+		if (d1 > WARM_CHI2 || d2-d1 < WARM_MARGIN || used[j])
+		    return false;
+		used[j] = 1;
+		assign[i] = j;
+	    }
+	    return true;
 	}
-    
 
-    // process_robots simply iterates through a sorted list of robots,
-    // and sends the appropriate transforms and topics
-    void process_robots(int op)
+
+    // grow cost_eig so that every solve can use its top left corner
+    void ensure_cost_size(int rows, int cols)
 	{
-	    for (int i=0; i<nr; i++)
+	    if (cost_eig.rows() < rows || cost_eig.cols() < cols)
+		cost_eig.resize(std::max((int) cost_eig.rows(), rows),
+				std::max((int) cost_eig.cols(), cols));
+	    return;
+	}
+
+
+    // Split the tracks and the points into groups that share
+    // candidate pairs, and solve the assignment for each group on
+    // its own.  Fills assign.
+    void solve_groups(int nc)
+	{
+	    // now split the tracks and points into connected groups;
+	    // tracks are nodes [0,nr) and points are [nr,nr+nc):
+	    parent.resize(nr+nc);
+	    for (int i=0; i<nr+nc; i++)
+		parent[i] = i;
+	    for (unsigned int k=0; k<pairs.size(); k++)
+	    {
+		int a = find_root(parent, pairs[k].first);
+		int b = find_root(parent, nr+pairs[k].second);
+		if (a != b)
+		    parent[b] = a;
+	    }
+	    // group[] maps a node to its group, and local[] to its
+	    // row or column within that group's cost matrix.  The
+	    // members of group g are group_bots[bot_start[g]] up to
+	    // group_bots[bot_start[g+1]], and the same for the points:
+	    group.assign(nr+nc, -1);
+	    local.resize(nr+nc);
+	    bot_start.assign(nr+nc+1, 0);
+	    pt_start.assign(nr+nc+1, 0);
+	    int ng = 0;
+	    for (int i=0; i<nr+nc; i++)
+	    {
+		int r = find_root(parent, i);
+		if (group[r] < 0)
+		    group[r] = ng++;
+		group[i] = group[r];
+		if (i < nr)
+		    local[i] = bot_start[group[i]+1]++;
+		else
+		    local[i] = pt_start[group[i]+1]++;
+	    }
+	    for (int g=0; g<ng; g++)
+	    {
+		bot_start[g+1] += bot_start[g];
+		pt_start[g+1] += pt_start[g];
+	    }
+	    group_bots.resize(nr);
+	    group_pts.resize(nc);
+	    for (int i=0; i<nr+nc; i++)
+	    {
+		if (i < nr)
+		    group_bots[bot_start[group[i]]+local[i]] = i;
+		else
+		    group_pts[pt_start[group[i]]+local[i]] = i-nr;
+	    }
+
+	    if (!over_budget)
+		ROS_DEBUG("Solving %d assignment problems", ng);
+	    // solve each group that has both tracks and points using
+	    // the squared Mahalanobis distance.  Each track also gets
+	    // a "missing" column that costs as much as a point on the
+	    // edge of its gate:
+	    ensure_cost_size(nr, nc+nr);
+	    assign.assign(nr, -1);
+	    for (int g=0; g<ng; g++)
+	    {
+		int nb = bot_start[g+1]-bot_start[g];
+		int np = pt_start[g+1]-pt_start[g];
+		if (nb == 0 || np == 0)
+		    continue;
+		const int *gb = &group_bots[bot_start[g]];
+		const int *gp = &group_pts[pt_start[g]];
+		Eigen::Block<Eigen::MatrixXd> cost =
+		    cost_eig.topLeftCorner(nb, np+nb);
+		cost.setConstant(NO_PAIR_COST);
+		cost.rightCols(nb).setConstant(GATE_CHI2);
+		for (int i=0; i<nb; i++)
+		    for (int k=pair_start[gb[i]]; k<pair_start[gb[i]+1]; k++)
+			cost(i, local[nr+pairs[k].second]) = pair_cost[k];
+		solve_assignment(cost, sub_assign, assign_work);
+		for (int i=0; i<nb; i++)
+		    if (sub_assign[i] < np && cost(i,sub_assign[i]) < NO_PAIR_COST)
+			assign[gb[i]] = gp[sub_assign[i]];
+	    }
+	    return;
+	}
+
+
+    // start all of the tracks as confirmed at the given positions
+    void reset_tracks(const puppeteer_msgs::Robots &r)
+	{
+	    for (int i=0; i<nr && i<(int) r.robots.size(); i++)
+	    {
+		fleet[i].track.state = TRACK_CONFIRMED;
+		fleet[i].track.hits = NUM_CONFIRM_HITS;
+		fleet[i].track.misses = 0;
+		fleet[i].track.pos << r.robots[i].point.x,
+		    r.robots[i].point.y, r.robots[i].point.z;
+		init_filter(i);
+		clear_heading(fleet[i].heading);
+	    }
+	    clutter_count = 0;
+	    return;
+	}
+
+
+    void clear_heading(HeadingWindow &w)
+	{
+	    w.next = w.count = 0;
+	    w.st = w.stt = w.sx = w.sz = w.stx = w.stz = w.sxx = w.szz = 0;
+	    return;
+	}
+
+
+    // add a point to the window, dropping the oldest one once it is
+    // full.  The sums are updated in place, except when the times
+    // get too far from base, and then they are rebuilt.
+    void add_heading_point(HeadingWindow &w, const ros::Time &stamp,
+			   double x, double z)
+	{
+	    if (w.count == 0)
+		w.base = stamp;
+	    double t = (stamp-w.base).toSec();
+	    if (t > HEADING_REBASE)
+	    {
+		double dt = t;
+		w.base = stamp;
+		w.st = w.stt = w.stx = w.stz = 0;
+		for (int k=0; k<w.count; k++)
+		{
+		    w.t[k] -= dt;
+		    w.st += w.t[k];
+		    w.stt += w.t[k]*w.t[k];
+		    w.stx += w.t[k]*w.x[k];
+		    w.stz += w.t[k]*w.z[k];
+		}
+		t = 0;
+	    }
+	    if (w.count == HEADING_WINDOW)
+	    {
+		int k = w.next;
+		w.st -= w.t[k];
+		w.stt -= w.t[k]*w.t[k];
+		w.sx -= w.x[k];
+		w.sz -= w.z[k];
+		w.stx -= w.t[k]*w.x[k];
+		w.stz -= w.t[k]*w.z[k];
+		w.sxx -= w.x[k]*w.x[k];
+		w.szz -= w.z[k]*w.z[k];
+	    }
+	    else
+		w.count++;
+	    w.t[w.next] = t;
+	    w.x[w.next] = x;
+	    w.z[w.next] = z;
+	    w.next = (w.next+1) % HEADING_WINDOW;
+	    w.st += t;
+	    w.stt += t*t;
+	    w.sx += x;
+	    w.sz += z;
+	    w.stx += t*x;
+	    w.stz += t*z;
+	    w.sxx += x*x;
+	    w.szz += z*z;
+	    return;
+	}
+
+
+    // fit a constant velocity to the window by least squares.  The
+    // heading is the direction of the velocity, and its variance is
+    // the variance of the velocity across its direction over the
+    // speed squared, so a robot that is barely moving gets
+    // kin_cov_ori like before.
+    void fit_heading(const HeadingWindow &w, double &theta, double &var)
+	{
+	    theta = 0.0;
+	    var = kin_cov_ori;
+	    if (w.count < 3)
+		return;
+	    double n = w.count;
+	    double ctt = w.stt-w.st*w.st/n;
+	    if (ctt <= 0)
+		return;
+	    double ctx = w.stx-w.st*w.sx/n;
+	    double ctz = w.stz-w.st*w.sz/n;
+	    double vx = ctx/ctt;
+	    double vz = ctz/ctt;
+	    // residual variance of the points about the fitted line,
+	    // but never less than the kinect's own noise:
+	    double res = (w.sxx-w.sx*w.sx/n-vx*ctx)+(w.szz-w.sz*w.sz/n-vz*ctz);
+	    double s2 = std::max(res/(2.0*(n-2.0)), MEAS_NOISE*MEAS_NOISE);
+	    double v2 = vx*vx+vz*vz;
+	    if (v2 <= 0)
+		return;
+	    theta = clamp_angle(atan2(vx, vz)-M_PI/2.0);
+	    var = std::min(std::max(s2/(ctt*v2), MIN_HEADING_VAR), kin_cov_ori);
+	    return;
+	}
+
+
+    // start a track's filter at rest at its current position
+    void init_filter(int i)
+	{
+	    Track &t = fleet[i].track;
+	    t.x << t.pos(0), t.pos(2), 0, 0;
+	    t.P.setZero();
+	    t.P(0,0) = t.P(1,1) = MEAS_NOISE*MEAS_NOISE;
+	    t.P(2,2) = t.P(3,3) = INIT_VEL_VAR;
+	    return;
+	}
+
+
+    // propagate a track's filter forward by dt using a constant
+    // velocity model driven by white acceleration noise.  Lost tracks
+    // are held where they were lost.
+    void predict_track(int i, double dt)
+	{
+	    Track &t = fleet[i].track;
+	    if (t.state == TRACK_LOST || dt <= 0)
+		return;
+	    Eigen::Matrix4d F = Eigen::Matrix4d::Identity();
+	    F(0,2) = F(1,3) = dt;
+	    Eigen::Matrix4d Q = Eigen::Matrix4d::Zero();
+	    Q(0,0) = Q(1,1) = CV_ACCEL_NOISE*dt*dt*dt/3.0;
+	    Q(0,2) = Q(2,0) = Q(1,3) = Q(3,1) = CV_ACCEL_NOISE*dt*dt/2.0;
+	    Q(2,2) = Q(3,3) = CV_ACCEL_NOISE*dt;
+	    t.x = F*t.x;
+	    t.P = F*t.P*F.transpose()+Q;
+	    t.pos(0) = t.x(0);
+	    t.pos(2) = t.x(1);
+	    return;
+	}
+
+
+    // innovation covariance of a track's position measurement
+    Eigen::Matrix2d track_innovation(int i)
+	{
+	    return fleet[i].track.P.topLeftCorner<2,2>()+
+		MEAS_NOISE*MEAS_NOISE*Eigen::Matrix2d::Identity();
+	}
+
+
+    // squared Mahalanobis distance from a track's predicted position
+    // to a point, using the inverse innovation covariance stored in
+    // sinv_eig
+    double track_distance(int i, const Eigen::Vector3d &pt)
+	{
+	    double dx = pt(0)-track_eig(0,i), dz = pt(2)-track_eig(2,i);
+	    return sinv_eig(0,i)*dx*dx+2.0*sinv_eig(1,i)*dx*dz+
+		sinv_eig(2,i)*dz*dz;
+	}
+
+
+    // fill the top left of dist_eig with the squared Mahalanobis
+    // distance from every predicted track to every point in det_eig
+    // in one pass
+    void track_distances(void)
+	{
+	    int nt = (int) track_eig.cols(), nc = (int) det_eig.cols();
+	    if (dx_arr.rows() < nt || dx_arr.cols() < nc)
+	    {
+		int rows = std::max((int) dx_arr.rows(), nt);
+		int cols = std::max((int) dx_arr.cols(), nc);
+		dx_arr.resize(rows, cols);
+		dz_arr.resize(rows, cols);
+		dxz_arr.resize(rows, cols);
+		dist_eig.resize(rows, cols);
+	    }
+	    Eigen::Block<Eigen::ArrayXXd> dx = dx_arr.topLeftCorner(nt, nc);
+	    Eigen::Block<Eigen::ArrayXXd> dz = dz_arr.topLeftCorner(nt, nc);
+	    Eigen::Block<Eigen::ArrayXXd> dxz = dxz_arr.topLeftCorner(nt, nc);
+	    dx = det_eig.row(0).replicate(nt,1).array();
+	    dz = det_eig.row(2).replicate(nt,1).array();
+	    dx.colwise() -= track_eig.row(0).transpose().array();
+	    dz.colwise() -= track_eig.row(2).transpose().array();
+	    dxz = 2.0*dx*dz;
+	    dx = dx.square();
+	    dz = dz.square();
+	    dx.colwise() *= sinv_eig.row(0).transpose().array();
+	    dxz.colwise() *= sinv_eig.row(1).transpose().array();
+	    dz.colwise() *= sinv_eig.row(2).transpose().array();
+	    dist_eig.topLeftCorner(nt, nc) = (dx+dxz+dz).matrix();
+	    return;
+	}
+
+
+    // move a track through its lifecycle given either a new
+    // measurement, or NULL if it was not seen this frame
+    void update_track(int i, const Eigen::Vector3d *meas)
+	{
+	    Track &t = fleet[i].track;
+	    if (meas != NULL)
+	    {
+		t.misses = 0;
+		t.hits++;
+		if (t.state == TRACK_LOST)
+		{
+		    ROS_INFO("Reacquired robot %d", fleet[i].id);
+		    t.state = TRACK_TENTATIVE;
+		    t.hits = 1;
+		    t.pos = *meas;
+		    init_filter(i);
+		}
+		else
+		{
+		    // standard Kalman update with H = [I 0]
+		    Eigen::Matrix<double,4,2> K =
+			t.P.leftCols<2>()*track_innovation(i).inverse();
+		    Eigen::Vector2d nu((*meas)(0)-t.x(0), (*meas)(2)-t.x(1));
+		    t.x += K*nu;
+		    t.P -= K*t.P.topRows<2>();
+		    t.pos = *meas;
+		    if (t.state == TRACK_COASTING)
+			t.state = TRACK_CONFIRMED;
+		    else if (t.state == TRACK_TENTATIVE &&
+			     t.hits >= NUM_CONFIRM_HITS)
+			t.state = TRACK_CONFIRMED;
+		}
+	    }
+	    else
+	    {
+		t.hits = 0;
+		t.misses++;
+		if (t.state == TRACK_TENTATIVE)
+		    t.state = TRACK_LOST;
+		else if (t.state == TRACK_CONFIRMED)
+		    t.state = TRACK_COASTING;
+		if (t.state == TRACK_COASTING && t.misses > NUM_COAST_FRAMES)
+		{
+		    ROS_WARN("Lost track of robot %d", fleet[i].id);
+		    t.state = TRACK_LOST;
+		}
+	    }
+	    return;
+	}
+
+
+    // the euclidean reach of a track's Mahalanobis gate, used to
+    // find candidate points in the grid; lost tracks are only
+    // matched against leftover points
+    double track_gate(int i)
+	{
+	    if (fleet[i].track.state == TRACK_LOST)
+		return 0.0;
+	    Eigen::Matrix2d S = track_innovation(i);
+	    double lmax = 0.5*(S.trace()+sqrt(pow(S(0,0)-S(1,1),2)+
+					      4.0*S(0,1)*S(0,1)));
+	    return sqrt(GATE_CHI2*lmax);
+	}
+
+
+    // how much to inflate the covariance of the published pose
+    // based on the state of the track
+    double track_cov_scale(int i)
+	{
+	    switch (fleet[i].track.state)
 	    {
-		send_kinect_estimate(current_bots_sorted.robots[i],
-				     prev_bots_sorted.robots[i], i, op);
+	    case TRACK_CONFIRMED:
+		return 1.0;
+	    case TRACK_TENTATIVE:
+		return TENTATIVE_COV_SCALE;
+	    case TRACK_COASTING:
+		return 1.0+COAST_COV_GROWTH*fleet[i].track.misses;
+	    default:
+		return LOST_COV_SCALE;
 	    }
+	}
+
+
+    // process_robots simply iterates through the robots in a
+    // snapshot, sends the appropriate topics, and fills in the
+    // first nr transforms in tf_batch.  fleet_mutex must be held.
+    void process_robots(const FleetSnapshot &s, int op)
+	{
+	    for (int i=0; i<nr; i++)
+		send_kinect_estimate(s, i, op);
 	    return;
 	}
 	
@@ -662,112 +2567,54 @@ public:
 
     // This function is responsible for converting the data from the
     // kinect into an odometry message, and tranforming it to the same
-    // frame that the ekf uses    
-    void send_kinect_estimate(geometry_msgs::PointStamped pt,
-			      geometry_msgs::PointStamped ptlast,
-			      int index, int op)
+    // frame that the ekf uses.  Everything about the robot in slot
+    // index comes from the snapshot s.
+    void send_kinect_estimate(const FleetSnapshot &s, int index, int op)
 	{
 	    ROS_DEBUG("send_kinect_estimate triggered");
 
-	    Eigen::Affine3d gwo;
-	    Eigen::Vector3d tmp_point; 
-	    tf::Transform transform;
-	    geometry_msgs::PointStamped transpt, transptlast;
-	    ros::Time tstamp = pt.header.stamp;
-	    
+	    ros::Time tstamp = s.stamps[index];
 
-	    // set transform parameters
-	    transform.setOrigin(tf::Vector3(cal_pos(0),
-					    cal_pos(1), cal_pos(2)));
-	    transform.setRotation(tf::Quaternion(0,0,0,1));
-
-	    // convert to Eigen:
-	    tf::TransformTFToEigen(transform, gwo);
-	    gwo = gwo.inverse();
-
-	    tmp_point << pt.point.x, pt.point.y, pt.point.z;
-	    tmp_point = gwo*tmp_point;
-	    transpt.header.frame_id = "optimization_frame";
-	    transpt.header.stamp = tstamp;
-	    transpt.point.x = tmp_point(0);
-	    transpt.point.y = tmp_point(1);
-	    transpt.point.z = tmp_point(2);
-
-	    tmp_point << ptlast.point.x, ptlast.point.y, ptlast.point.z;
-	    tmp_point = gwo*tmp_point;
-	    transptlast.header.frame_id = "optimization_frame";
-	    transptlast.header.stamp = tstamp;
-	    transptlast.point.x = tmp_point(0);
-	    transptlast.point.y = tmp_point(1);
-	    transptlast.point.z = tmp_point(2);
-	    
-	    ROS_DEBUG("Done transforming PointStamped messages");
-	    // Let's first get the transform from /optimization_frame
-	    // to /map
-	    tf::StampedTransform trans_stamped;
-	    geometry_msgs::PointStamped tmp;
-	    try{
-	    	tf.lookupTransform(
-	    	    "map", "optimization_frame",
-	    	    tstamp, trans_stamped);
-	    	tf.transformPoint("map", transpt, tmp);
-
-	    }
-	    catch(tf::TransformException& ex){
-	    	ROS_ERROR(
-	    	    "Error trying to lookupTransform from /map "
-	    	    "to /optimization_frame: %s", ex.what());
-	    	return;
-	    }
-	    
 	    // Now we can publish the Kinect's estimate of the robot's
-	    // pose
-	    std::stringstream ss;
-	    ss << "base_footprint_kinect_robot_" << index;
-	    kin_pose[index].header.stamp = ros::Time::now();
-	    kin_pose[index].header.frame_id = "map";
-	    kin_pose[index].child_frame_id = ss.str();
-	    tmp.point.z = 0.0;
-	    kin_pose[index].pose.pose.position = tmp.point;
+	    // pose, stamped with the time the kinect saw it; the frame
+	    // ids were filled in by register_robot, and the point was
+	    // already moved into /map by store_snapshot
+	    fleet[index].kin_pose.header.stamp = tstamp;
+	    fleet[index].kin_pose.pose.pose.position.x = s.map(0,index);
+	    fleet[index].kin_pose.pose.pose.position.y = s.map(1,index);
+	    fleet[index].kin_pose.pose.pose.position.z = 0.0;
 	    double theta = 0.0;
+	    double theta_var = kin_cov_ori;
 	    if (op == 2)
 	    {
-	    	theta = atan2(transpt.point.x-
-	    			     transptlast.point.x,
-	    			     transpt.point.z-
-	    			     transptlast.point.z);
-	    	theta = clamp_angle(theta-M_PI/2.0);
+		theta = s.heading(index);
+		theta_var = s.heading_var(index);
 		ROS_DEBUG("Calculated angle = %f",theta);					  
 	    }
 	    else
 	    {
-	    	theta = robot_start_ori[index];
+	    	theta = s.start_ori(index);
 	    	theta = clamp_angle(-theta);
 		ROS_DEBUG("predetermined angle = %f",theta);
 	    }
 	    geometry_msgs::Quaternion quat = tf::createQuaternionMsgFromYaw(theta);
-	    kin_pose[index].pose.pose.orientation = quat;
+	    fleet[index].kin_pose.pose.pose.orientation = quat;
 
-	    // Let's check if this is a "bad" point
-	    if (bad_array[index])
-	    {
-		boost::array<double,36ul> tmpcov;
-		for (int i=0; i<36; i++)
-		    tmpcov[i] = kincov[i]*1000.0;
-		kin_pose[index].pose.covariance = tmpcov;
-	    }
-	    else
-		kin_pose[index].pose.covariance = kincov;
+	    // Let's check if this track is not being measured
+	    double cov_scale = s.cov_scale(index);
+	    for (int i=0; i<36; i++)
+		fleet[index].kin_pose.pose.covariance[i] = kincov[i]*cov_scale;
+	    fleet[index].kin_pose.pose.covariance[35] = theta_var*cov_scale;
 	    
 	    ROS_DEBUG("Done filling in Odometry message");
 
 	    // Now let's publish the estimated pose as a
 	    // nav_msgs/Odometry message on a topic called /vo
-	    ROS_DEBUG("publishing /vo for robot %d", index+1);
-	    robots_pub[index].publish(kin_pose[index]);
+	    ROS_DEBUG("publishing /vo for robot %d", fleet[index].id);
+	    fleet[index].pub.publish(fleet[index].kin_pose);
 
-	    // now, let's publish the transforms that goes along with it
-	    geometry_msgs::TransformStamped kin_trans;
+	    // now, let's batch the transform that goes along with it
+	    geometry_msgs::TransformStamped &kin_trans = tf_batch[index];
 	    tf::Quaternion q1, q2;
 	    q1 = tf::createQuaternionFromYaw(theta);
 	    q2 = tf::Quaternion(1.0,0,0,0);
@@ -775,53 +2622,69 @@ public:
 	    tf::quaternionTFToMsg(q1, quat);
 
 	    kin_trans.header.stamp = tstamp;
-	    kin_trans.header.frame_id = kin_pose[index].header.frame_id;
-	    kin_trans.child_frame_id = kin_pose[index].child_frame_id;
-	    kin_trans.transform.translation.x = kin_pose[index].pose.pose.position.x;
-	    kin_trans.transform.translation.y = kin_pose[index].pose.pose.position.y;
-	    kin_trans.transform.translation.z = kin_pose[index].pose.pose.position.z;
+	    kin_trans.header.frame_id = fleet[index].kin_pose.header.frame_id;
+	    kin_trans.child_frame_id = fleet[index].kin_pose.child_frame_id;
+	    kin_trans.transform.translation.x = fleet[index].kin_pose.pose.pose.position.x;
+	    kin_trans.transform.translation.y = fleet[index].kin_pose.pose.pose.position.y;
+	    kin_trans.transform.translation.z = fleet[index].kin_pose.pose.pose.position.z;
 	    kin_trans.transform.rotation = quat;
-
-	    ROS_DEBUG("Sending transform for output of estimator node");
-	    br.sendTransform(kin_trans);
 	    
 	    return;
 	}
 
+    // copy the /vo estimate of every robot, along with the state of
+    // its track, into a single message for the whole fleet
+    void send_fleet_pose(const FleetSnapshot &s)
+	{
+	    fleet_msg.header.stamp = s.frame_stamp;
+	    fleet_msg.robots.resize(nr);
+	    for (int i=0; i<nr; i++)
+	    {
+		fleet_msg.robots[i].id = fleet[i].id;
+		fleet_msg.robots[i].state = s.states[i];
+		fleet_msg.robots[i].pose = fleet[i].kin_pose.pose;
+	    }
+	    ROS_DEBUG("publishing fleet pose");
+	    fleet_pub.publish(fleet_msg);
+	    return;
+	}
+
     double clamp_angle(double theta)
 	{
 	    double th = theta;
 	    while(th > M_PI)
 		th -= 2.0*M_PI;
-	    while(th <= M_PI)
+	    while(th <= -M_PI)
 		th += 2.0*M_PI;
 	    return th;
 	}
 
-    // this function accounts for the size of the robot:
-    puppeteer_msgs::Robots adjust_for_robot_size(puppeteer_msgs::Robots &p)
+    // this function accounts for the size of the robot by pushing
+    // every point away from the kinect by the robot's radius.  All
+    // of the points are corrected at once into det_eig, and p is
+    // left alone.
+    void adjust_for_robot_size(const puppeteer_msgs::Robots &p)
 	{
 	    ROS_DEBUG("correct_vals called");
-	    puppeteer_msgs::Robots point;
-	    Eigen::Vector3d ur;
-	    point = p;
-
-	    for (unsigned int j=0; j<p.number; j++)
-	    {
-		// let's create a unit vector from the kinect frame to the
-		// robot's location
-		ur << p.robots[j].point.x, p.robots[j].point.y, p.robots[j].point.z;
-		// now turn it into a unit vector:
-		ur = ur/ur.norm();
-		// now we can correct the values of point
-		ur = ur*robot_radius[j];
-	    
-		point.robots[j].point.x = point.robots[j].point.x+ur(0);
-		point.robots[j].point.y = point.robots[j].point.y+ur(1);
-		point.robots[j].point.z = point.robots[j].point.z+ur(2);
+	    int nc = (int) p.robots.size();
+	    if (det_buf.cols() < nc)
+	    {
+		det_buf.resize(Eigen::NoChange, nc);
+		rad_eig.resize(nc);
 	    }
-	    
-	    return(point);	    	    
+	    new (&det_eig) PointsMap(det_buf.data(), 3, nc);
+	    for (int j=0; j<nc; j++)
+	    {
+		det_eig(0,j) = p.robots[j].point.x;
+		det_eig(1,j) = p.robots[j].point.y;
+		det_eig(2,j) = p.robots[j].point.z;
+	    }
+	    Eigen::VectorBlock<Eigen::RowVectorXd> rad = rad_eig.head(nc);
+	    for (int j=0; j<nc; j++)
+		rad(j) = (j < nr ? fleet[j].radius : DEFAULT_RADIUS);
+	    rad.array() /= det_eig.colwise().norm().array();
+	    det_eig.array().rowwise() *= 1.0+rad.array();
+	    return;
 	}
     
 }; // end Coordinator Class
@@ -829,81 +2692,179 @@ public:
 
 
 //---------------------------------------------------------------------------
-// PERMUTATION FUNCTIONS
+// ASSIGNMENT FUNCTIONS
 //---------------------------------------------------------------------------
 
-void add_to_tab(char reset, int num, int *p, int **tab)
+// This function solves the linear assignment problem for a cost
+// matrix with no more rows than columns using the Hungarian method
+// (O(rows^2*cols)).  On return, assign[i] holds the column that row i
+// is assigned to, and the total cost of the assignment is returned.
+// The cost can be any matrix expression, so blocks of a bigger
+// buffer work, and all of the bookkeeping lives in work.
+template <typename Derived>
+double solve_assignment(const Eigen::MatrixBase<Derived> &cost,
+			std::vector<int> &assign, AssignmentWork &work)
 {
-    static int count=0;
-    if (reset)
-	count = 0;
-    int i;
-    for (i=1; i <= num; ++i)
-	tab[count][i-1]=p[i];
-    count++;
+    int n = (int) cost.rows();
+    int m = (int) cost.cols();
+    const double inf = std::numeric_limits<double>::infinity();
+    // potentials are 1-indexed, p[j] is the row assigned to column
+    // j and way[j] is the previous column on the augmenting path
+    std::vector<double> &u = work.u, &v = work.v, &minv = work.minv;
+    std::vector<int> &p = work.p, &way = work.way;
+    std::vector<char> &used = work.used;
+    u.assign(n+1, 0.0);
+    v.assign(m+1, 0.0);
+    minv.resize(m+1);
+    p.assign(m+1, 0);
+    way.assign(m+1, 0);
+    used.resize(m+1);
+
+    assign.assign(n, -1);
+    if (n > m)
+    {
+	ROS_ERROR("Assignment problem has more rows than columns");
+	return inf;
+    }
+
+    for (int i=1; i<=n; i++)
+    {
+	p[0] = i;
+	int j0 = 0;
+	std::fill(minv.begin(), minv.end(), inf);
+	std::fill(used.begin(), used.end(), 0);
+	do
+	{
+	    used[j0] = 1;
+	    int i0 = p[j0], j1 = 0;
+	    double delta = inf;
+	    for (int j=1; j<=m; j++)
+	    {
+		if (used[j])
+		    continue;
+		double cur = cost(i0-1,j-1)-u[i0]-v[j];
+		if (cur < minv[j])
+		{
+		    minv[j] = cur;
+		    way[j] = j0;
+		}
+		if (minv[j] < delta)
+		{
+		    delta = minv[j];
+		    j1 = j;
+		}
+	    }
+	    for (int j=0; j<=m; j++)
+	    {
+		if (used[j])
+		{
+		    u[p[j]] += delta;
+		    v[j] -= delta;
+		}
+		else
+		    minv[j] -= delta;
+	    }
+	    j0 = j1;
+	} while (p[j0] != 0);
+	// now walk back along the augmenting path:
+	do
+	{
+	    int j1 = way[j0];
+	    p[j0] = p[j1];
+	    j0 = j1;
+	} while (j0 != 0);
+    }
+
+    double total = 0;
+    for (int j=1; j<=m; j++)
+    {
+	if (p[j] != 0)
+	{
+	    assign[p[j]-1] = j-1;
+	    total += cost(p[j]-1,j-1);
+	}
+    }
+    return total;
 }
 
-void move_perm_entry( int x, int d, int *p, int *pi)
-{
-   int z;
-   z = p[pi[x]+d];
-   p[pi[x]] = z;
-   p[pi[x]+d] = x;
-   pi[z] = pi[x];
-   pi[x] = pi[x]+d;
-} 
 
 
-void permute(int n, int num, int *dir, int *p, int *pi, int **tab)
+//---------------------------------------------------------------------------
+// GATING FUNCTIONS
+//---------------------------------------------------------------------------
+
+// pack the integer coordinates of a grid cell in the ground plane
+// into a single key
+long long grid_key(int ix, int iz)
 {
-    int i;
-    if (n > num)
-	add_to_tab(0, num, p, tab);
-    else
-    {
-    	permute(n+1, num, dir, p, pi, tab );
-    	for (i=1; i<=n-1; ++i)
-    	{
-    	    move_perm_entry(n, dir[n], p, pi);
-    	    permute(n+1, num, dir, p, pi, tab);
-    	}
-    	dir[n] = -dir[n];
-    } 
+    const long long off = 1LL<<30;
+    return (((ix+off) << 32) | (iz+off));
 }
 
-
-void generate_perm_table(int num, int **tab)
+// This function finds every (track, point) pair whose ground plane
+// (x,z) distance is within that track's gate, as in track_distances;
+// the height plays no part.  The points are bucketed into a uniform
+// grid over x and z with the given cell size, so each track only has
+// to check the points in the cells that its gate overlaps.  The pairs
+// come out ordered by track, and cells is only used as working space.
+void find_gated_pairs(const Eigen::Matrix3Xd &tracks,
+		      const Eigen::VectorXd &gates,
+		      const PointsMap &points,
+		      double cell, GridCells &cells,
+		      std::vector<std::pair<int,int> > &pairs)
 {
-    int *perm, *dir, *permi;
-    int height = 1;
-    for (int j=1; j<=num; j++)
-	height *= j;
-    // allocate memory:
-    perm = new int[num];
-    permi = new int[num];
-    dir = new int[num];
-
-    // initialize variables:
-    perm[0]=0;
-    permi[0]=0;
-    dir[0]=0;
-    for (int i=1; i<=num; ++i)
+    pairs.clear();
+    if (cell <= 0 || points.cols() == 0)
+	return;
+
+    // bucket the points by sorting on their cell keys:
+    cells.resize(points.cols());
+    for (int j=0; j<(int) points.cols(); j++)
     {
-	dir[i] = -1; perm[i] = i;
-	permi[i] = i;
+	cells[j].first = grid_key((int) floor(points(0,j)/cell),
+				  (int) floor(points(2,j)/cell));
+	cells[j].second = j;
     }
+    std::sort(cells.begin(), cells.end());
 
-    // build permutations and add to tab
-    permute(1, num, dir, perm, permi, tab);
-
-    delete [] dir;
-    delete [] perm;
-    delete [] permi;
-    
-    return;    
+    // now check the neighborhood of each track:
+    for (int i=0; i<(int) tracks.cols(); i++)
+    {
+	if (gates(i) <= 0)
+	    continue;
+	int reach = (int) ceil(gates(i)/cell);
+	int cx = (int) floor(tracks(0,i)/cell);
+	int cz = (int) floor(tracks(2,i)/cell);
+	double g2 = gates(i)*gates(i);
+	for (int dx=-reach; dx<=reach; dx++)
+	    for (int dz=-reach; dz<=reach; dz++)
+	    {
+		std::pair<long long,int> lo(grid_key(cx+dx, cz+dz), -1);
+		GridCells::iterator it =
+		    std::lower_bound(cells.begin(), cells.end(), lo);
+		for (; it != cells.end() && it->first == lo.first; ++it)
+		{
+		    double ex = tracks(0,i)-points(0,it->second);
+		    double ez = tracks(2,i)-points(2,it->second);
+		    if (ex*ex+ez*ez <= g2)
+			pairs.push_back(std::make_pair(i, it->second));
+		}
+	    }
+    }
+    return;
 }
 
-
+// find the root of element i in a union-find forest, compressing the
+// path along the way
+int find_root(std::vector<int> &parent, int i)
+{
+    while (parent[i] != i)
+    {
+	parent[i] = parent[parent[i]];
+	i = parent[i];
+    }
+    return i;
+}
 
 
 
@@ -924,8 +2885,10 @@ int main(int argc, char **argv)
 
     ROS_INFO("Starting Coordinator Node...\n");
     Coordinator coord;
+    coord.start();
   
-    ros::spin();
+    // the coordinator spins its own threads
+    ros::waitForShutdown();
   
     return 0;
 }
@@ -42,6 +42,9 @@
 #include <string>
 #include <sstream>
 
+#include "command_sender.h"
+#include "trajectory.h"
+
 
 //---------------------------------------------------------------------------
 // Global Variables
@@ -74,19 +77,11 @@ template<typename T>
 class KinematicControl{
 
 private:
-    typedef struct
-    {
-	int RobotMY;
-	float DT;
-	unsigned int num;
-	float vals[][6]; // unknown length;
-			 // t,x,y,Vd,Wd,r
-    } Trajectory;       
-
     int operating_condition;
-    Trajectory *traj;
+    Trajectory traj;
+    int RobotMY;
     ros::NodeHandle n_;
-    ros::ServiceClient client;
+    CommandSender sender;
     ros::Subscriber sub;
     ros::Timer timer;
     ros::Publisher ref_pub, rpath_pub;
@@ -123,9 +118,8 @@ public:
 	    ros::param::set("winch_bool",false);
 	}
 	
-	// Define service client:
-	client = n_.serviceClient<puppeteer_msgs::speed_command>
-	    ("/speed_command");
+	// Start sending commands:
+	sender.start("/speed_command");
 	// Define subscriber:
 	sub = n_.subscribe("pose_ekf", 10, &KinematicControl::subscriber_cb
 			   , this);
@@ -137,7 +131,7 @@ public:
 	rpath_pub = n_.advertise<nav_msgs::Path> ("desired_path_robot", 100);
 
 	// Read in the trajectory:
-	traj = ReadControls(filename);
+	ReadControls(filename);
 	// publish the robot results:
 	set_robot_path();
 		
@@ -189,13 +183,11 @@ public:
 		    ROS_DEBUG("Sending initial pose.");
 
 		    // set parameters for sending initial pose
-		    srv.request.robot_index = traj->RobotMY;
+		    srv.request.robot_index = RobotMY;
 		    srv.request.type = 'l';
-		    srv.request.Vleft = traj->vals[0][1];
-		    srv.request.Vright = traj->vals[0][2];
-		    srv.request.Vtop = atan2(
-			traj->vals[1][2]-traj->vals[0][2],
-			traj->vals[1][1]-traj->vals[0][1]);
+		    srv.request.Vleft = traj(0,TRAJ_X);
+		    srv.request.Vright = traj(0,TRAJ_Y);
+		    srv.request.Vtop = start_heading();
 		    srv.request.div = 4;
 
 		    cal_start_flag = false;
@@ -212,13 +204,11 @@ public:
 		    ROS_INFO("Beginning movement execution");
 
 		    // set parameters for sending initial pose
-		    srv.request.robot_index = traj->RobotMY;
+		    srv.request.robot_index = RobotMY;
 		    srv.request.type = 'l';
-		    srv.request.Vleft = traj->vals[0][1];
-		    srv.request.Vright = traj->vals[0][2];
-		    srv.request.Vtop = atan2(
-			traj->vals[1][2]-traj->vals[0][2],
-			traj->vals[1][1]-traj->vals[0][1]);
+		    srv.request.Vleft = traj(0,TRAJ_X);
+		    srv.request.Vright = traj(0,TRAJ_Y);
+		    srv.request.Vtop = start_heading();
 		    srv.request.div = 4;
 
 		    start_flag = false;
@@ -238,9 +228,9 @@ public:
 		    running_time = ((ros::Time::now()).toSec()-
 				    base_time.toSec());
 		    ROS_DEBUG("Running time is %f", running_time);
-		    ROS_DEBUG("Final time is %f", traj->vals[num-1][0]);
+		    ROS_DEBUG("Final time is %f", traj.final_time());
 		    // check that running_time is less than the final time:
-		    if (running_time <= traj->vals[num-1][0])
+		    if (running_time <= traj.final_time())
 		    {
 			get_desired_pose(running_time, pose);
 			get_control_values(pose);
@@ -265,7 +255,7 @@ public:
 	    else if (operating_condition == 4)
 	    {
 		ROS_WARN("Emergency Stop Detected!");
-		srv.request.robot_index = traj->RobotMY;
+		srv.request.robot_index = RobotMY;
 		srv.request.type = 'h';
 		srv.request.Vleft = 0.0;
 		srv.request.Vright = 0.0;
@@ -276,23 +266,7 @@ public:
 	    }
 	    
 	    // send request to service
-	    if(client.call(srv))
-	    {
-		if(srv.response.error == false)
-		    ROS_DEBUG("Send Successful: speed_command\n");
-		else
-		{
-		    ROS_DEBUG("Send Request Denied: speed_command\n");
-		    static bool request_denied_notify = true;
-		    if(request_denied_notify)
-		    {
-			ROS_WARN("Send Requests Denied: speed_command\n");
-			request_denied_notify = false;
-		    }
-		}
-	    }
-	    else 
-		ROS_ERROR("Failed to call service: speed_command\n");
+	    sender.send(srv.request);
 	}
 
     void get_desired_pose(float time, const nav_msgs::Odometry &p)
@@ -304,33 +278,20 @@ public:
 
 	    // first we iterate through the array to find the right
 	    // time entry
-	    unsigned int index;
 	    float mult;
-	    for (index=0; index<num; index++)
-	    {
-		if (traj->vals[index][0] > time)
-		    break;
-	    }
-	    mult = (time-traj->vals[index-1][0])/traj->DT;
-	    desired_x = (traj->vals[index-1][1]) +
-		mult*(traj->vals[index][1]-traj->vals[index-1][1]);
-	    desired_y = (traj->vals[index-1][2]) +
-		mult*(traj->vals[index][2]-traj->vals[index-1][2]);
-	    // now, let's estimate the desired orientation to do this
-	    // we just draw a straight line from the current point to
-	    // the next point
-	    desired_th = atan2(traj->vals[index][2]-desired_y,
-			       traj->vals[index][1]-desired_x);
+	    unsigned int index = traj.find(time, mult);
+	    // the pose and the feedforward terms come straight from
+	    // the splines through the trajectory
+	    TrajSample ref;
+	    traj.sample(index, mult, ref);
+	    desired_x = ref.x;
+	    desired_y = ref.y;
+	    desired_th = ref.th;
 	    if (isnan(desired_th) == 0)
 		desired_th = clamp_angle(desired_th);
-
-	    // Now, we can interpolate the feedforward terms:
-	    vd = (traj->vals[index-1][3])+
-		mult*(traj->vals[index][3]-traj->vals[index-1][3]);
-	    wd = (traj->vals[index-1][4])+
-		mult*(traj->vals[index][4]-traj->vals[index-1][4]);
-	    rdotd = (traj->vals[index-1][5])+
-	    	mult*(traj->vals[index][5]-traj->vals[index-1][5]);
+	    vd = ref.v;
+	    wd = ref.w;
+	    rdotd = traj.interp(index, mult, TRAJ_EXTRA);
 
 	    ROS_DEBUG("Desired values at time t = %f", time);
 	    ROS_DEBUG("Xd = %f\tYd = %f\tTd = %f\t",
@@ -420,7 +381,7 @@ public:
 	    ROS_DEBUG("Sending control values: v = %f\tw = %f",v,omega);
 
 	    // Set service parameters:
-	    srv.request.robot_index = traj->RobotMY;
+	    srv.request.robot_index = RobotMY;
 	    srv.request.type = 'd';
 	    srv.request.Vleft = v;
 	    srv.request.Vright = omega;
@@ -438,7 +399,7 @@ public:
 	{
 	    ROS_DEBUG("Sending start flag");
 	    // First set the parameters for the service call
-	    srv.request.robot_index = traj->RobotMY;
+	    srv.request.robot_index = RobotMY;
 	    srv.request.type = 'm';
 	    srv.request.Vleft = 0.0;
 	    srv.request.Vright = 0.0;
@@ -446,102 +407,26 @@ public:
 	    srv.request.div = 0;
 
 	    // send request to service
-	    if(client.call(srv))
-	    {
-		if(srv.response.error == false)
-		    ROS_DEBUG("Send Successful: speed_command\n");
-		else
-		{
-		    ROS_DEBUG("Send Request Denied: speed_command\n");
-		    static bool request_denied_notify = true;
-		    if(request_denied_notify)
-		    {
-			ROS_WARN("Send Requests Denied: speed_command\n");
-			request_denied_notify = false;
-		    }
-		}
-	    }
-	    else 
-		ROS_ERROR("Failed to call service: speed_command\n");
+	    sender.send(srv.request);
 	}
 
 
-    Trajectory *ReadControls(std::string filename)
+    void ReadControls(std::string filename)
 	{
-	    unsigned int i,j;
-	    float temp_float, xd, xdd, yd, ydd, xdp, ydp;
-	    std::string line, temp;
-	    Trajectory *traj;
-	    std::ifstream file;
-	    file.open(filename.c_str(), std::fstream::in);
-	    // Read line telling us the number of data points:
-	    getline(file, line);
-	    std::stringstream ss(line);
-	    ss >> temp >> num;
-	    ROS_DEBUG("Number of time points = %d",num);
-
-	    // Now we can initialize the trajectory struct:
-	    size_t alloc;
-	    alloc = sizeof(*traj) + sizeof(traj->vals[0])*num;
-	    traj = (Trajectory*) malloc(alloc);
-	    
-	    // Now, we can start reading in the important file stuff:
-	    for (i=0; i<num; i++)
-	    {
-		for (j=0; j<3; j++)
-		{
-		    // fill out t,x,y
-		    getline(file, line, ',');
-		    std::stringstream ss(line);
-		    ss >> temp_float;
-		    traj->vals[i][j] = temp_float;
-		}
-		// fill out r
-		getline(file, line);
-		std::stringstream ss(line);
-		ss >> temp_float;
-		traj->vals[i][5] = temp_float;
-	    }
-	    file.close();
-	    
-	    // Now we can set DT and the robot_index
-	    ros::param::get("robot_index", traj->RobotMY);
-	    traj->DT = traj->vals[1][0]-traj->vals[0][0];
-	    traj->num = num;
-
-	    // Now let's set the feedforward terms in the vals array:
-	    for (i=0; i<num-2; i++)
-	    {
-		xd = (traj->vals[i+1][1]-traj->vals[i][1])/
-		    (traj->vals[i+1][0]-traj->vals[i][0]);
-		yd = (traj->vals[i+1][2]-traj->vals[i][2])/
-		    (traj->vals[i+1][0]-traj->vals[i][0]);
-		xdp = (traj->vals[i+2][1]-traj->vals[i+1][1])/
-		    (traj->vals[i+2][0]-traj->vals[i+1][0]);
-		ydp = (traj->vals[i+2][2]-traj->vals[i+1][2])/
-		    (traj->vals[i+2][0]-traj->vals[i+1][0]);
-		xdd = (xdp-xd)/(traj->vals[i+1][0]-traj->vals[i][0]);
-		ydd = (ydp-yd)/(traj->vals[i+1][0]-traj->vals[i][0]);
-		// Now we can calculate the angular and translational
-		// velocities of the robot:
-		traj->vals[i][3] = sqrt(pow(xd,2)+pow(yd,2));
-		traj->vals[i][4] = (ydd*xd-xdd*yd)/(pow(xd,2)+pow(yd,2));
+	    if (!traj.read(filename, 1))
+		exit(1);
+	    num = traj.size();
 
-	    }
-	    // Now, let's fill out the last few entries:
-	    traj->vals[num-2][3] = traj->vals[num-3][3];
-	    traj->vals[num-2][4] = traj->vals[num-3][4];
-	    traj->vals[num-1][3] = traj->vals[num-3][3];
-	    traj->vals[num-1][4] = traj->vals[num-3][4];
+	    // Now we can set the robot_index
+	    ros::param::get("robot_index", RobotMY);
 
 	    // let's set some parameters for the initial pose of the robot:
-	    ros::param::set("robot_x0", traj->vals[0][1]);
-	    ros::param::set("robot_z0", traj->vals[0][2]);
+	    ros::param::set("robot_x0", traj(0,TRAJ_X));
+	    ros::param::set("robot_z0", traj(0,TRAJ_Y));
 	    ros::param::set("robot_y0", 1.0); // this value is arbitrary!
-	    ros::param::set("robot_r0", traj->vals[0][5]);
+	    ros::param::set("robot_r0", traj(0,TRAJ_EXTRA));
 
-	    double th = atan2(traj->vals[1][2]-traj->vals[0][2],
-			      traj->vals[1][1]-traj->vals[0][1]);
+	    double th = start_heading();
 	    
 	    if (isnan(th) == 0)
 	    {
@@ -551,7 +436,14 @@ public:
 	    else
 		ROS_ERROR("Initial angle returned NaN!");
 
-	    return traj;
+	}
+
+    // the heading of the trajectory as it starts
+    double start_heading(void)
+	{
+	    TrajSample ref;
+	    traj.sample(1, 0.0, ref);
+	    return ref.th;
 	}
 
     double clamp_angle(const double theta)
@@ -589,13 +481,13 @@ public:
 
     void set_robot_path(void)
 	{
-	    path_r.poses.resize(traj->num);
+	    path_r.poses.resize(traj.size());
 	    path_r.header.frame_id = "robot_odom_pov";
-	    for (unsigned int i=0; i<(traj->num); i++)
+	    for (unsigned int i=0; i<(traj.size()); i++)
 	    {
 		path_r.poses[i].header.frame_id = "robot_odom_pov";
-		path_r.poses[i].pose.position.x = traj->vals[i][1];
-		path_r.poses[i].pose.position.y = traj->vals[i][2];
+		path_r.poses[i].pose.position.x = traj(i,TRAJ_X);
+		path_r.poses[i].pose.position.y = traj(i,TRAJ_Y);
 		path_r.poses[i].pose.position.z = 0;
 	    }
 	}
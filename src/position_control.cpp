@@ -39,6 +39,9 @@
 #include <string>
 #include <sstream>
 
+#include "command_sender.h"
+#include "trajectory.h"
+
 
 //---------------------------------------------------------------------------
 // Global Variables
@@ -61,18 +64,11 @@ template <typename T> int sgn(T val)
 class KinematicControl{
 
 private:
-    typedef struct
-    {
-	int RobotMY;
-	float DT;
-	unsigned int num;
-	float vals[][8]; // unknown length; t,x,y,Vd,Wd,hleft,hright
-    } Trajectory;       
-
     int operating_condition;
-    Trajectory *traj;
+    Trajectory traj;
+    int RobotMY;
     ros::NodeHandle n_;
-    ros::ServiceClient client, client2;
+    CommandSender sender;
     // ros::Subscriber sub;
     ros::Timer timer;
     puppeteer_msgs::speed_command srv;
@@ -96,11 +92,10 @@ public:
 	}
 	
 	// Read in the trajectory:
-	traj = ReadControls(filename);
+	ReadControls(filename);
 
-	// Define service client:
-	client = n_.serviceClient<puppeteer_msgs::speed_command>("speed_command");
-	client2 = n_.serviceClient<puppeteer_msgs::long_command>("long_command");
+	// Start sending commands:
+	sender.start("speed_command", "long_command");
 	// Define subscriber:
 	// sub = n_.subscribe("/robot_pose", 1, &KinematicControl::subscriber_cb, this);
 	// Define timer:
@@ -137,22 +132,22 @@ public:
 		    ROS_INFO("Beginning movement execution");
 
 		    // set parameters for sending initial pose
-		    // srv.request.robot_index = traj->RobotMY;
+		    // srv.request.robot_index = RobotMY;
 		    // srv.request.type = 'l';
-		    // srv.request.Vleft = traj->vals[0][1];
-		    // srv.request.Vright = traj->vals[0][2];
-		    // srv.request.Vtop = atan2(traj->vals[1][2]-traj->vals[0][2],
-		    // 			     traj->vals[1][1]-traj->vals[0][1]);
+		    // srv.request.Vleft = traj(0,TRAJ_X);
+		    // srv.request.Vright = traj(0,TRAJ_Y);
+		    // srv.request.Vtop = atan2(traj(1,TRAJ_Y)-traj(0,TRAJ_Y),
+		    // 			     traj(1,TRAJ_X)-traj(0,TRAJ_X));
 		    // srv.request.div = 4;
 
-		    srv2.request.robot_index = traj->RobotMY;
+		    srv2.request.robot_index = RobotMY;
 		    srv2.request.type = 'a';
-		    srv2.request.num1 = traj->vals[0][1];
-		    srv2.request.num2 = traj->vals[0][2];
-		    srv2.request.num3 = atan2(traj->vals[1][2]-traj->vals[0][2],
-		    			     traj->vals[1][1]-traj->vals[0][1]);
-		    srv2.request.num4 = traj->vals[0][5];
-		    srv2.request.num5 = traj->vals[0][6];
+		    srv2.request.num1 = traj(0,TRAJ_X);
+		    srv2.request.num2 = traj(0,TRAJ_Y);
+		    srv2.request.num3 = atan2(traj(1,TRAJ_Y)-traj(0,TRAJ_Y),
+		    			     traj(1,TRAJ_X)-traj(0,TRAJ_X));
+		    srv2.request.num4 = traj(0,TRAJ_EXTRA);
+		    srv2.request.num5 = traj(0,TRAJ_EXTRA+1);
 		    srv2.request.div = 4;
 		    long_flag = true;
 
@@ -169,9 +164,9 @@ public:
 		    running_time = ((ros::Time::now()).toSec()-
 				    base_time.toSec());
 		    // ROS_INFO("Running time = %f", running_time);
-		    // ROS_INFO("Final time = %f\t at index = %f",traj->vals[num-1][0]);
+		    // ROS_INFO("Final time = %f\t at index = %f",traj.final_time());
 		    // check that running_time is less than the final time:
-		    if (running_time <= traj->vals[num-1][0])
+		    if (running_time <= traj.final_time())
 		    {
 			ROS_DEBUG("Getting desired pose and control values");
 			get_desired_pose(running_time);
@@ -181,7 +176,7 @@ public:
 		    {
 			// stop robot!
 			ROS_INFO("Trajectory Finished!");
-			srv.request.robot_index = traj->RobotMY;
+			srv.request.robot_index = RobotMY;
 			srv.request.type = 'h';
 			srv.request.Vleft = 0.0;
 			srv.request.Vright = 0.0;
@@ -197,7 +192,7 @@ public:
 	    else if (operating_condition == 4)
 	    {
 		ROS_WARN_THROTTLE(5,"Emergency Stop Detected!");
-		srv.request.robot_index = traj->RobotMY;
+		srv.request.robot_index = RobotMY;
 		srv.request.type = 'h';
 		srv.request.Vleft = 0.0;
 		srv.request.Vright = 0.0;
@@ -216,46 +211,15 @@ public:
 
     void service_call(bool flag)
 	{
+	    // a time step is relative, and the robot adds them up
 	    if(flag)
 	    {
-		if(client2.call(srv2))
-		{
-		    if(srv2.response.error == false)
-			ROS_DEBUG("Send Successful: long_command");
-		    else
-		    {
-			ROS_DEBUG("Send Request Denied: long_command");
-			static bool request_denied_notify = true;
-			if(request_denied_notify)
-			{
-			    ROS_INFO("Send Requests Denied: long_command");
-			    request_denied_notify = false;
-			}
-		    }
-		}
-		else 
-		    ROS_ERROR("Failed to call service: long_command\n");
+		sender.send(srv2.request, srv2.request.type == 't');
 	    }
 	    
 	    else
 	    {
-		if(client.call(srv))
-		{
-		    if(srv.response.error == false)
-			ROS_DEBUG("Send Successful: speed_command");
-		    else
-		    {
-			ROS_DEBUG("Send Request Denied: speed_command");
-			static bool request_denied_notify = true;
-			if(request_denied_notify)
-			{
-			    ROS_INFO("Send Requests Denied: speed_command");
-			    request_denied_notify = false;
-			}
-		    }
-		}
-		else 
-		    ROS_ERROR("Failed to call service: speed_command\n");
+		sender.send(srv.request);
 	    }
 	    return;
 	}
@@ -268,24 +232,13 @@ public:
 
 	    // first we iterate through the array to find the right
 	    // time entry
-	    unsigned int index;
 	    float mult;
-	    for (index=0; index<num; index++)
-	    {
-		if (traj->vals[index][0] > time)
-		    break;
-	    }
-	    mult = (time-traj->vals[index-1][0])/traj->DT;
-	    desired_x = (traj->vals[index-1][1]) +
-		mult*(traj->vals[index][1]-traj->vals[index-1][1]);
-	    desired_y = (traj->vals[index-1][2]) +
-		mult*(traj->vals[index][2]-traj->vals[index-1][2]);
-	    desired_hl = (traj->vals[index-1][5]) +
-		mult*(traj->vals[index][5]-traj->vals[index-1][5]);
-	    desired_hr = (traj->vals[index-1][6]) +
-		mult*(traj->vals[index][6]-traj->vals[index-1][6]);
-	    float desired_time = (traj->vals[index-1][7]) +
-		mult*(traj->vals[index][7]-traj->vals[index-1][7]);
+	    unsigned int index = traj.find(time, mult);
+	    desired_x = traj.interp(index, mult, TRAJ_X);
+	    desired_y = traj.interp(index, mult, TRAJ_Y);
+	    desired_hl = traj.interp(index, mult, TRAJ_EXTRA);
+	    desired_hr = traj.interp(index, mult, TRAJ_EXTRA+1);
+	    float desired_time = traj.interp(index, mult, TRAJ_EXTRA+2);
 
 	    static float desired_time_last = desired_time;
 	    
@@ -295,14 +248,14 @@ public:
 		     desired_x, desired_y, desired_hl, desired_hr);
 
 	    // Set service parameters:
-	    // srv.request.robot_index = traj->RobotMY;
+	    // srv.request.robot_index = RobotMY;
 	    // srv.request.type = 'k';
 	    // srv.request.Vleft = time;
 	    // srv.request.Vright = desired_x;
 	    // srv.request.Vtop = desired_y;
 	    // srv.request.div = 4;
 
-	    srv2.request.robot_index = traj->RobotMY;
+	    srv2.request.robot_index = RobotMY;
 	    srv2.request.type = 't';
 	    srv2.request.num1 = desired_time-desired_time_last;
 	    srv2.request.num2 = desired_x;
@@ -318,7 +271,7 @@ public:
     void send_start_flag(void)
 	{
 	    // First set the parameters for the service call
-	    srv.request.robot_index = traj->RobotMY;
+	    srv.request.robot_index = RobotMY;
 	    srv.request.type = 'm';
 	    srv.request.Vleft = 0.0;
 	    srv.request.Vright = 0.0;
@@ -326,113 +279,18 @@ public:
 	    srv.request.div = 0;
 
 	    // send request to service
-	    if(client.call(srv))
-	    {
-	    	if(srv.response.error == false)
-	    	    ROS_DEBUG("Send Successful: speed_command\n");
-	    	else
-	    	{
-	    	    ROS_DEBUG("Send Request Denied: speed_command\n");
-	    	    static bool request_denied_notify = true;
-	    	    if(request_denied_notify)
-	    	    {
-	    		ROS_INFO("Send Requests Denied: speed_command\n");
-	    		request_denied_notify = false;
-	    	    }
-	    	}
-	    }
-	    else 
-	    	ROS_ERROR("Failed to call service: speed_command\n");
+	    sender.send(srv.request);
 	}
 
 
-    Trajectory *ReadControls(std::string filename)
+    void ReadControls(std::string filename)
 	{
-	    unsigned int i,j;
-	    float temp_float, xd, xdd, yd, ydd, xdp, ydp;
-	    std::string line, temp;
-	    Trajectory *traj;
-	    std::ifstream file;
-	    file.open(filename.c_str(), std::fstream::in);
-	    // Read line telling us the number of data points:
-	    getline(file, line);
-	    std::stringstream ss(line);
-	    ss >> temp >> num;
-	    ROS_DEBUG("Number of time points = %d",num);
-
-	    // Now we can initialize the trajectory struct:
-	    size_t alloc;
-	    alloc = sizeof(*traj) + sizeof(traj->vals[0])*num;
-	    traj = (Trajectory*) malloc(alloc);
-	    
-	    // Now, we can start reading in the important file stuff:
-	    for (i=0; i<num; i++)
-	    {
-		// read in time, x, y
-		for (j=0; j<3; j++)
-		{		
-		    getline(file, line, ',');
-		    std::stringstream ss(line);
-		    ss >> temp_float;
-		    traj->vals[i][j] = temp_float;
-		    // printf("%f\t", temp_float);
-		}
-
-		// read in hleft, hright
-		getline(file, line, ',');
-		std::stringstream ss(line);
-		ss >> temp_float;
-		traj->vals[i][5] = temp_float;
-		// printf("%f\t",temp_float);
-
-		getline(file, line, ',');
-		std::stringstream ss2(line);
-		ss2 >> temp_float;
-		traj->vals[i][6] = temp_float;
-
-		
-		getline(file, line);
-		std::stringstream ss3(line);
-		ss3 >> temp_float;
-		traj->vals[i][7] = temp_float;
-		
-		// printf("%f\t",temp_float);
-		
-		// printf("\n");
-	    }
-	    file.close();
-	    
-	    // Now we can set DT and the robot_index
-	    ros::param::get("/robot_index", traj->RobotMY);
-	    traj->DT = traj->vals[1][0]-traj->vals[0][0];
-	    traj->num = num;
-
-	    // Now let's set the feedforward terms in the vals array:
-	    for (i=0; i<num-2; i++)
-	    {
-		xd = (traj->vals[i+1][1]-traj->vals[i][1])/
-		    (traj->vals[i+1][0]-traj->vals[i][0]);
-		yd = (traj->vals[i+1][2]-traj->vals[i][2])/
-		    (traj->vals[i+1][0]-traj->vals[i][0]);
-		xdp = (traj->vals[i+2][1]-traj->vals[i+1][1])/
-		    (traj->vals[i+2][0]-traj->vals[i+1][0]);
-		ydp = (traj->vals[i+2][2]-traj->vals[i+1][2])/
-		    (traj->vals[i+2][0]-traj->vals[i+1][0]);
-		xdd = (xdp-xd)/(traj->vals[i+1][0]-traj->vals[i][0]);
-		ydd = (ydp-yd)/(traj->vals[i+1][0]-traj->vals[i][0]);
-		// Now we can calculate the angular and translational
-		// velocities of the robot:
-		traj->vals[i][3] = sqrt(pow(xd,2)+pow(yd,2));
-		traj->vals[i][4] = (ydd*xd-xdd*yd)/(pow(xd,2)+pow(yd,2));
-
-	    }
-	    // Now, let's fill out the last few entries:
-	    traj->vals[num-2][3] = traj->vals[num-3][3];
-	    traj->vals[num-2][4] = traj->vals[num-3][4];
-	    traj->vals[num-1][3] = traj->vals[num-3][3];
-	    traj->vals[num-1][4] = traj->vals[num-3][4];
+	    if (!traj.read(filename, 3))
+		exit(1);
+	    num = traj.size();
 
-	    return traj;
+	    // Now we can set the robot_index
+	    ros::param::get("/robot_index", RobotMY);
 	}
 };
 
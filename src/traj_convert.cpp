@@ -0,0 +1,47 @@
+// traj_convert.cpp
+//
+// Convert a text trajectory file, as written by data/traj_gen.py, to
+// the binary format that the controllers map instead of parsing.
+// Every column of the text file is kept, along with the feedforward
+// terms computed from it.
+
+
+//---------------------------------------------------------------------------
+// Includes
+//---------------------------------------------------------------------------
+
+#include <ros/ros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "trajectory.h"
+
+
+//---------------------------------------------------------------------------
+// Main
+//---------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+	fprintf(stderr, "Usage: %s text-file binary-file\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+    std::string in = argv[1], out = argv[2];
+
+    Trajectory traj;
+    if (!traj.read(in, -1))
+	exit(EXIT_FAILURE);
+    if (traj.mapped())
+	fprintf(stderr, "Warning: %s is already binary\n", in.c_str());
+    if (!traj.write(out))
+	exit(EXIT_FAILURE);
+
+    printf("Wrote %u points with %d extra columns, ending at t = %f, "
+	   "to %s\n", traj.size(), traj.columns()-TRAJ_EXTRA,
+	   traj.final_time(), out.c_str());
+    return 0;
+}
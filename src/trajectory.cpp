@@ -0,0 +1,515 @@
+// trajectory.cpp
+//
+// The reference trajectory that the controllers share; see
+// trajectory.h.
+
+
+//---------------------------------------------------------------------------
+// Includes
+//---------------------------------------------------------------------------
+
+#include <ros/ros.h>
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+#include "trajectory.h"
+
+
+//---------------------------------------------------------------------------
+// Global Variables
+//---------------------------------------------------------------------------
+#define UNIFORM_TOL (1.0e-3) // relative spread of DT that is still uniform
+#define MAX_CURSOR_STEPS (4) // before find() falls back to a search
+#define MIN_HEADING_SPEED (1.0e-4) // below which the spline has no heading
+#define KNOT_SPACING (0.1) // seconds between the knots of the splines
+
+
+//---------------------------------------------------------------------------
+// Trajectory
+//---------------------------------------------------------------------------
+
+Trajectory::Trajectory()
+{
+    data = NULL;
+    mapping = NULL;
+    mapping_len = 0;
+    clear();
+}
+
+
+Trajectory::~Trajectory()
+{
+    clear();
+}
+
+
+void Trajectory::clear(void)
+{
+    if (mapping != NULL)
+	munmap(mapping, mapping_len);
+    mapping = NULL;
+    mapping_len = 0;
+    vals.clear();
+    data = NULL;
+    num = 0;
+    cols = TRAJ_EXTRA;
+    uniform = false;
+    dt = 0.0;
+    cursor = 1;
+}
+
+
+bool Trajectory::read(const std::string &filename, int extra)
+{
+    clear();
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+	ROS_ERROR("Cannot open trajectory file %s", filename.c_str());
+	return false;
+    }
+
+    // binary files start with the magic number, and anything else
+    // should be text
+    uint32_t magic = 0;
+    bool ok;
+    if (::read(fd, &magic, sizeof(magic)) == sizeof(magic) &&
+	magic == TRAJ_MAGIC)
+    {
+	ok = read_binary(fd, filename, extra);
+	close(fd);
+    }
+    else
+    {
+	close(fd);
+	ok = read_text(filename, extra);
+    }
+    if (!ok)
+	clear();
+    return ok;
+}
+
+
+bool Trajectory::read_text(const std::string &filename, int extra)
+{
+    std::ifstream file;
+    std::string line, temp;
+    file.open(filename.c_str(), std::fstream::in);
+    if (!file.is_open())
+    {
+	ROS_ERROR("Cannot open trajectory file %s", filename.c_str());
+	return false;
+    }
+
+    // Read line telling us the number of data points:
+    getline(file, line);
+    std::stringstream ss(line);
+    ss >> temp >> num;
+    ROS_DEBUG("Number of time points = %d",num);
+    if (num < 3)
+    {
+	ROS_ERROR("Trajectory %s needs at least 3 points", filename.c_str());
+	return false;
+    }
+
+    // keep every column of the first point?
+    if (extra < 0)
+    {
+	std::streampos start = file.tellg();
+	getline(file, line);
+	file.seekg(start);
+	extra = 0;
+	for (size_t k=0; k<line.size(); k++)
+	    if (line[k] == ',')
+		extra++;
+	extra = (extra > 2 ? extra-2 : 0);
+    }
+
+    // one line per point; anything after the columns we want is
+    // ignored, and missing ones are left at zero
+    cols = TRAJ_EXTRA+extra;
+    vals.assign(num*cols, 0.0f);
+    for (unsigned int i=0; i<num; i++)
+    {
+	if (!getline(file, line))
+	{
+	    ROS_ERROR("Trajectory %s ends after %u of %u points",
+		      filename.c_str(), i, num);
+	    return false;
+	}
+	parse_point(line, extra, &vals[i*cols]);
+    }
+    file.close();
+    data = &vals[0];
+    for (unsigned int i=1; i<num; i++)
+	if ((*this)(i, TRAJ_T) <= (*this)(i-1, TRAJ_T))
+	{
+	    ROS_ERROR("Trajectory %s goes back in time at point %u",
+		      filename.c_str(), i);
+	    return false;
+	}
+
+    // are the points evenly spaced in time?
+    dt = (*this)(1, TRAJ_T)-(*this)(0, TRAJ_T);
+    uniform = (dt > 0);
+    for (unsigned int i=1; uniform && i<num; i++)
+	if (fabs((*this)(i, TRAJ_T)-(*this)(i-1, TRAJ_T)-dt) > UNIFORM_TOL*dt)
+	    uniform = false;
+
+    set_splines();
+    for (unsigned int i=0; i<num; i++)
+    {
+	unsigned int lo, hi;
+	float h = (i+1 < num ? (*this)(i+1, TRAJ_T)-(*this)(i, TRAJ_T) :
+		   (*this)(i, TRAJ_T)-(*this)(i-1, TRAJ_T));
+	feedforward_span(i, num, h, lo, hi);
+	feedforward(&vals[i*cols], &vals[lo*cols], &vals[(lo+hi)/2*cols],
+		    &vals[hi*cols]);
+    }
+    return true;
+}
+
+
+// map a binary file written by write().  The feedforward terms and
+// the spacing were found when it was written, so nothing is parsed
+// or computed here.
+bool Trajectory::read_binary(int fd, const std::string &filename, int extra)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(TrajHeader))
+    {
+	ROS_ERROR("Trajectory %s is too short", filename.c_str());
+	return false;
+    }
+    mapping_len = st.st_size;
+    mapping = mmap(NULL, mapping_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+	ROS_ERROR("Cannot map trajectory file %s", filename.c_str());
+	mapping = NULL;
+	return false;
+    }
+
+    const TrajHeader *head = (const TrajHeader *) mapping;
+    if (head->version != TRAJ_VERSION)
+    {
+	ROS_ERROR("Trajectory %s is version %u; expected %d",
+		  filename.c_str(), head->version, TRAJ_VERSION);
+	return false;
+    }
+    if (head->num < 3 || head->cols < TRAJ_EXTRA ||
+	head->offset%sizeof(float) != 0 ||
+	head->offset+(double) head->num*head->cols*sizeof(float) >
+	mapping_len)
+    {
+	ROS_ERROR("Trajectory %s is corrupt", filename.c_str());
+	return false;
+    }
+    if (!check_layout(*head, filename))
+	return false;
+    if ((int) head->cols < TRAJ_EXTRA+extra)
+    {
+	ROS_ERROR("Trajectory %s has %u extra columns; need %d",
+		  filename.c_str(), head->cols-TRAJ_EXTRA, extra);
+	return false;
+    }
+
+    num = head->num;
+    cols = head->cols;
+    uniform = (head->uniform != 0);
+    dt = head->dt;
+    data = (const float *) ((const char *) mapping+head->offset);
+    // the whole file is about to be used
+    madvise(mapping, mapping_len, MADV_WILLNEED);
+    return true;
+}
+
+
+// write the trajectory as a binary file, going through a temporary
+// file so that a controller never maps half of one
+bool Trajectory::write(const std::string &filename) const
+{
+    if (num == 0)
+	return false;
+    std::string tmp = filename+".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (fp == NULL)
+    {
+	ROS_ERROR("Cannot write %s", tmp.c_str());
+	return false;
+    }
+    TrajHeader head;
+    memset(&head, 0, sizeof(head));
+    head.magic = TRAJ_MAGIC;
+    head.version = TRAJ_VERSION;
+    head.num = num;
+    head.cols = cols;
+    head.uniform = uniform;
+    head.dt = dt;
+    head.offset = (sizeof(head)+TRAJ_ALIGN-1)/TRAJ_ALIGN*TRAJ_ALIGN;
+    head.extra_at = TRAJ_EXTRA;
+    head.extra_from = TRAJ_FILE_EXTRA;
+    std::vector<char> pad(head.offset-sizeof(head), 0);
+    bool ok = (fwrite(&head, sizeof(head), 1, fp) == 1);
+    ok = ok && (pad.empty() || fwrite(&pad[0], pad.size(), 1, fp) == 1);
+    ok = ok && (fwrite(data, sizeof(float), num*cols, fp) ==
+		  (size_t) num*cols);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), filename.c_str()) != 0)
+    {
+	ROS_ERROR("Cannot save the trajectory to %s", filename.c_str());
+	remove(tmp.c_str());
+	return false;
+    }
+    return true;
+}
+
+
+// fill in a point's columns from a line of a text file
+void Trajectory::parse_point(const std::string &line, int extra, float *p)
+{
+    std::string temp;
+    std::stringstream ls(line);
+    for (int j=0; j<TRAJ_FILE_EXTRA+extra && getline(ls, temp, ','); j++)
+    {
+	int c = (j < TRAJ_FILE_EXTRA ? j : TRAJ_EXTRA+j-TRAJ_FILE_EXTRA);
+	std::stringstream vs(temp);
+	vs >> p[c];
+    }
+    return;
+}
+
+
+// are the extra columns of a binary file where we would put them,
+// and did they come from the same columns of the text file?
+bool Trajectory::check_layout(const TrajHeader &head,
+			      const std::string &filename)
+{
+    if (head.extra_at != TRAJ_EXTRA || head.extra_from != TRAJ_FILE_EXTRA)
+    {
+	ROS_ERROR("Trajectory %s keeps text columns %u on from column %u; "
+		  "expected text columns %d on from column %d",
+		  filename.c_str(), head.extra_from, head.extra_at,
+		  TRAJ_FILE_EXTRA, TRAJ_EXTRA);
+	return false;
+    }
+    return true;
+}
+
+
+// the points either side of point i, of n, that its feedforward
+// terms are found from: about TRAJ_FF_SPAN away, going by the time dt
+// to the next point, and at most TRAJ_FF_STEPS.  Near the ends the
+// points are all on one side.  There must be at least 3 points.
+void Trajectory::feedforward_span(unsigned int i, unsigned int n, float dt,
+				  unsigned int &lo, unsigned int &hi)
+{
+    unsigned int k = 1;
+    if (dt > 0 && TRAJ_FF_SPAN/dt > 1.5)
+	k = std::min((unsigned int) (TRAJ_FF_SPAN/dt+0.5),
+		     (unsigned int) TRAJ_FF_STEPS);
+    lo = (i >= k ? i-k : 0);
+    hi = std::min(i+k, n-1);
+    if (hi-lo < 2)
+    {
+	if (lo == 0)
+	    hi = 2;
+	else
+	    lo = hi-2;
+    }
+    return;
+}
+
+
+// find the translational and angular velocities at point p from the
+// parabolas through x and y at points a, b and c.  Points further
+// apart than the file's rows keep the rounding of the values in the
+// file out of the curvature.
+void Trajectory::feedforward(float *p, const float *a, const float *b,
+			     const float *c)
+{
+    double hab = b[TRAJ_T]-a[TRAJ_T], hbc = c[TRAJ_T]-b[TRAJ_T];
+    double hac = c[TRAJ_T]-a[TRAJ_T], tp = 2.0*p[TRAJ_T]-a[TRAJ_T]-b[TRAJ_T];
+    double xab = (b[TRAJ_X]-a[TRAJ_X])/hab, xbc = (c[TRAJ_X]-b[TRAJ_X])/hbc;
+    double yab = (b[TRAJ_Y]-a[TRAJ_Y])/hab, ybc = (c[TRAJ_Y]-b[TRAJ_Y])/hbc;
+    double xdd = 2.0*(xbc-xab)/hac, ydd = 2.0*(ybc-yab)/hac;
+    double xd = xab+xdd*tp/2.0, yd = yab+ydd*tp/2.0;
+    // Now we can calculate the angular and translational
+    // velocities of the robot:
+    double v2 = xd*xd+yd*yd;
+    p[TRAJ_VD] = sqrt(v2);
+    if (p[TRAJ_VD] > MIN_HEADING_SPEED)
+	p[TRAJ_WD] = (xd*ydd-yd*xdd)/v2;
+    else
+	p[TRAJ_WD] = 0.0;
+    return;
+}
+
+
+// fit cubic splines through x and y, keeping their second derivatives
+// at every point.  The knots are KNOT_SPACING apart, as a spline
+// through every point of a densely sampled file bends to follow the
+// rounding of its values.  Past the end knots the curvature is held,
+// rather than being zero there.
+void Trajectory::set_splines(void)
+{
+    unsigned int i, k;
+    std::vector<unsigned int> knot(1, 0);
+    for (i=1; i<num; i++)
+	if ((*this)(i, TRAJ_T)-(*this)(knot.back(), TRAJ_T) >= KNOT_SPACING ||
+	    i == num-1)
+	    knot.push_back(i);
+    // no short last segment
+    if (knot.size() > 2 && (*this)(num-1, TRAJ_T)-
+	(*this)(knot[knot.size()-2], TRAJ_T) < KNOT_SPACING/2)
+	knot.erase(knot.end()-2);
+    unsigned int nk = knot.size();
+
+    std::vector<double> cp(nk), dp(nk), mk(nk, 0.0);
+    for (int c=TRAJ_X; c<=TRAJ_Y; c++)
+    {
+	int m = (c == TRAJ_X ? TRAJ_XDD : TRAJ_YDD);
+	// the tridiagonal system for the inner knots, solved by
+	// elimination; the end knots take the curvature of the ones
+	// next to them
+	for (k=1; k+1<nk; k++)
+	{
+	    unsigned int i0 = knot[k-1], i1 = knot[k], i2 = knot[k+1];
+	    double h0 = (*this)(i1, TRAJ_T)-(*this)(i0, TRAJ_T);
+	    double h1 = (*this)(i2, TRAJ_T)-(*this)(i1, TRAJ_T);
+	    double r = 6.0*(((*this)(i2, c)-(*this)(i1, c))/h1-
+			    ((*this)(i1, c)-(*this)(i0, c))/h0);
+	    double den = 2.0*(h0+h1);
+	    if (k == 1)
+		den += h0;
+	    else
+		den -= h0*cp[k-1];
+	    if (k+2 == nk)
+		den += h1;
+	    cp[k] = h1/den;
+	    dp[k] = (r-(k > 1 ? h0*dp[k-1] : 0.0))/den;
+	}
+	if (nk > 2)
+	{
+	    mk[nk-2] = dp[nk-2];
+	    for (k=nk-3; k>0; k--)
+		mk[k] = dp[k]-cp[k]*mk[k+1];
+	    mk[0] = mk[1];
+	    mk[nk-1] = mk[nk-2];
+	}
+
+	// between the knots the second derivative is linear
+	for (k=1; k<nk; k++)
+	{
+	    double t0 = (*this)(knot[k-1], TRAJ_T);
+	    double h = (*this)(knot[k], TRAJ_T)-t0;
+	    for (i=knot[k-1]; i<=knot[k]; i++)
+		vals[i*cols+m] = mk[k-1]+
+		    ((*this)(i, TRAJ_T)-t0)/h*(mk[k]-mk[k-1]);
+	}
+    }
+    return;
+}
+
+
+void Trajectory::sample(unsigned int i, float mult, TrajSample &s) const
+{
+    const float *p0 = &data[(i-1)*cols];
+    const float *p1 = &data[i*cols];
+    double h = p1[TRAJ_T]-p0[TRAJ_T];
+    double a = 1.0-mult, b = mult;
+    double xd, yd, xdd, ydd;
+    s.x = a*p0[TRAJ_X]+b*p1[TRAJ_X]+
+	((a*a*a-a)*p0[TRAJ_XDD]+(b*b*b-b)*p1[TRAJ_XDD])*h*h/6.0;
+    s.y = a*p0[TRAJ_Y]+b*p1[TRAJ_Y]+
+	((a*a*a-a)*p0[TRAJ_YDD]+(b*b*b-b)*p1[TRAJ_YDD])*h*h/6.0;
+    xd = (p1[TRAJ_X]-p0[TRAJ_X])/h-
+	((3.0*a*a-1.0)*p0[TRAJ_XDD]-(3.0*b*b-1.0)*p1[TRAJ_XDD])*h/6.0;
+    yd = (p1[TRAJ_Y]-p0[TRAJ_Y])/h-
+	((3.0*a*a-1.0)*p0[TRAJ_YDD]-(3.0*b*b-1.0)*p1[TRAJ_YDD])*h/6.0;
+    xdd = a*p0[TRAJ_XDD]+b*p1[TRAJ_XDD];
+    ydd = a*p0[TRAJ_YDD]+b*p1[TRAJ_YDD];
+
+    double v2 = xd*xd+yd*yd;
+    s.v = sqrt(v2);
+    if (s.v > MIN_HEADING_SPEED)
+    {
+	s.th = atan2(yd, xd);
+	s.w = (xd*ydd-yd*xdd)/v2;
+    }
+    else
+    {
+	s.th = atan2(p1[TRAJ_Y]-p0[TRAJ_Y], p1[TRAJ_X]-p0[TRAJ_X]);
+	s.w = 0.0;
+    }
+    return;
+}
+
+
+unsigned int Trajectory::find(float t, float &mult)
+{
+    // guess the segment; evenly spaced points can be indexed, and
+    // otherwise time usually moves forward a segment at a time
+    unsigned int i = cursor;
+    if (uniform)
+    {
+	float k = (t-(*this)(0, TRAJ_T))/dt;
+	if (k < 0)
+	    i = 1;
+	else if (k >= num-2)
+	    i = num-1;
+	else
+	    i = (unsigned int) k+1;
+    }
+
+    // and walk from there, unless it's far off
+    int steps = 0;
+    while (i > 1 && (*this)(i-1, TRAJ_T) > t && steps < MAX_CURSOR_STEPS)
+    {
+	i--;
+	steps++;
+    }
+    while (i < num-1 && (*this)(i, TRAJ_T) <= t && steps < MAX_CURSOR_STEPS)
+    {
+	i++;
+	steps++;
+    }
+    if (steps == MAX_CURSOR_STEPS)
+	i = search(t);
+    cursor = i;
+
+    float t0 = (*this)(i-1, TRAJ_T);
+    mult = (t-t0)/((*this)(i, TRAJ_T)-t0);
+    if (mult < 0)
+	mult = 0;
+    else if (mult > 1)
+	mult = 1;
+    return i;
+}
+
+
+// binary search for the first point after t, in [1, num-1]
+unsigned int Trajectory::search(float t) const
+{
+    unsigned int lo = 1, hi = num-1;
+    while (lo < hi)
+    {
+	unsigned int mid = (lo+hi)/2;
+	if ((*this)(mid, TRAJ_T) > t)
+	    hi = mid;
+	else
+	    lo = mid+1;
+    }
+    return lo;
+}
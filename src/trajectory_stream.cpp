@@ -0,0 +1,322 @@
+// trajectory_stream.cpp
+//
+// A trajectory that is read while it is being followed; see
+// trajectory_stream.h.
+
+
+//---------------------------------------------------------------------------
+// Includes
+//---------------------------------------------------------------------------
+
+#include <ros/ros.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include "trajectory_stream.h"
+
+
+//---------------------------------------------------------------------------
+// Global Variables
+//---------------------------------------------------------------------------
+#define MAX_CURSOR_STEPS (4) // before find() falls back to a search
+
+
+//---------------------------------------------------------------------------
+// TrajectoryStream
+//---------------------------------------------------------------------------
+
+TrajectoryStream::TrajectoryStream()
+{
+    binary = false;
+    extra = 0;
+    cols = TRAJ_EXTRA;
+    total = 0;
+    first = ready = loaded = 0;
+    ended = true;
+    cursor = 1;
+    underrun_count = 0;
+    stopping = false;
+}
+
+
+TrajectoryStream::~TrajectoryStream()
+{
+    close();
+}
+
+
+bool TrajectoryStream::open(const std::string &name, int ex)
+{
+    close();
+    filename = name;
+    extra = std::max(ex, 0);
+    first = ready = loaded = 0;
+    ended = false;
+    cursor = 1;
+    underrun_count = 0;
+    stopping = false;
+    if (!open_file())
+    {
+	close();
+	return false;
+    }
+
+    // the start of the trajectory is needed right away, so the first
+    // chunk is read here
+    read_chunk();
+    if (loaded < 3 || ready < 3)
+    {
+	ROS_ERROR("Trajectory %s needs at least 3 points", filename.c_str());
+	close();
+	return false;
+    }
+    if (!ended)
+	reader = boost::thread(&TrajectoryStream::run, this);
+    return true;
+}
+
+
+bool TrajectoryStream::rewind(void)
+{
+    {
+	// nothing is read past the ring, so until a point is dropped
+	// every point that has been read is still held
+	boost::mutex::scoped_lock lock(mutex);
+	if (first == 0)
+	{
+	    cursor = 1;
+	    return true;
+	}
+    }
+    return open(filename, extra);
+}
+
+
+void TrajectoryStream::close(void)
+{
+    {
+	boost::mutex::scoped_lock lock(mutex);
+	stopping = true;
+	space.notify_all();
+    }
+    if (reader.joinable())
+	reader.join();
+    if (file.is_open())
+	file.close();
+    file.clear();
+    return;
+}
+
+
+// open the file and read its header
+bool TrajectoryStream::open_file(void)
+{
+    file.open(filename.c_str(), std::fstream::in | std::fstream::binary);
+    if (!file.is_open())
+    {
+	ROS_ERROR("Cannot open trajectory file %s", filename.c_str());
+	return false;
+    }
+
+    // the file may be a pipe, so it can only be read once
+    uint32_t magic = 0;
+    file.read((char *) &magic, sizeof(magic));
+    std::streamsize got = file.gcount();
+    if (got == sizeof(magic) && magic == TRAJ_MAGIC)
+    {
+	TrajHeader head;
+	head.magic = magic;
+	file.read((char *) &head+sizeof(magic), sizeof(head)-sizeof(magic));
+	if (file.gcount() != (std::streamsize) (sizeof(head)-sizeof(magic)) ||
+	    head.version != TRAJ_VERSION || head.offset < sizeof(head) ||
+	    (int) head.cols < TRAJ_EXTRA+extra)
+	{
+	    ROS_ERROR("Trajectory %s is corrupt, is the wrong version, or "
+		      "has too few columns", filename.c_str());
+	    return false;
+	}
+	if (!Trajectory::check_layout(head, filename))
+	    return false;
+	binary = true;
+	total = head.num;
+	cols = head.cols;
+	file.ignore(head.offset-sizeof(head));
+    }
+    else
+    {
+	// Read line telling us the number of data points:
+	std::string line, temp;
+	file.clear();
+	getline(file, line);
+	line = std::string((const char *) &magic, got)+line;
+	std::stringstream ss(line);
+	if (!(ss >> temp >> total))
+	{
+	    ROS_ERROR("Trajectory %s has no \"num=\" line", filename.c_str());
+	    return false;
+	}
+	binary = false;
+	cols = TRAJ_EXTRA+extra;
+    }
+    ring.assign(STREAM_CAPACITY*cols, 0.0f);
+    return true;
+}
+
+
+// read the next chunk of points, which there must be room for, and
+// make them available to find(); returns how many were read
+unsigned int TrajectoryStream::read_chunk(void)
+{
+    unsigned int n = 0;
+    bool end = false;
+    std::string line;
+    while (n < STREAM_CHUNK)
+    {
+	unsigned int i = loaded+n;
+	if (total != 0 && i >= total)
+	{
+	    end = true;
+	    break;
+	}
+	float *p = row(i);
+	if (binary)
+	{
+	    file.read((char *) p, cols*sizeof(float));
+	    if (file.gcount() != (std::streamsize) (cols*sizeof(float)))
+	    {
+		end = true;
+		break;
+	    }
+	}
+	else
+	{
+	    if (!getline(file, line))
+	    {
+		end = true;
+		break;
+	    }
+	    if (line.find_first_not_of(" \t\r") == std::string::npos)
+		continue;
+	    std::fill(p, p+cols, 0.0f);
+	    Trajectory::parse_point(line, extra, p);
+	}
+	n++;
+    }
+    unsigned int now = loaded+n;
+    if (end && total != 0 && now < total)
+	ROS_WARN("Trajectory %s ends after %u of %u points",
+		 filename.c_str(), now, total);
+
+    // text points get their feedforward terms once the points they
+    // are found from have been read, as for a Trajectory
+    unsigned int rdy = now;
+    if (!binary)
+    {
+	unsigned int i, lo, hi;
+	for (i=ready; i<now && now >= 3 && (end || i+TRAJ_FF_STEPS < now); i++)
+	{
+	    float h = (i+1 < now ? row(i+1)[TRAJ_T]-row(i)[TRAJ_T] :
+		       row(i)[TRAJ_T]-row(i-1)[TRAJ_T]);
+	    Trajectory::feedforward_span(i, now, h, lo, hi);
+	    Trajectory::feedforward(row(i), row(lo), row((lo+hi)/2), row(hi));
+	}
+	rdy = i;
+    }
+
+    boost::mutex::scoped_lock lock(mutex);
+    loaded = now;
+    ready = rdy;
+    ended = end;
+    return n;
+}
+
+
+// the reader thread: keep the ring full until the file ends
+void TrajectoryStream::run(void)
+{
+    while (true)
+    {
+	{
+	    boost::mutex::scoped_lock lock(mutex);
+	    while (!stopping && loaded+STREAM_CHUNK-first > STREAM_CAPACITY)
+		space.wait(lock);
+	    if (stopping)
+		return;
+	}
+	read_chunk();
+	if (ended)
+	    return;
+    }
+}
+
+
+unsigned int TrajectoryStream::find(float t, float &mult)
+{
+    boost::mutex::scoped_lock lock(mutex);
+    unsigned int lo = first+1, hi = ready-1;
+
+    // walk from the last segment, unless it's far off
+    unsigned int i = std::min(std::max(cursor, lo), hi);
+    int steps = 0;
+    while (i > lo && (*this)(i-1, TRAJ_T) > t && steps < MAX_CURSOR_STEPS)
+    {
+	i--;
+	steps++;
+    }
+    while (i < hi && (*this)(i, TRAJ_T) <= t && steps < MAX_CURSOR_STEPS)
+    {
+	i++;
+	steps++;
+    }
+    if (steps == MAX_CURSOR_STEPS)
+	i = search(lo, hi, t);
+    cursor = i;
+
+    if (i == hi && t > (*this)(hi, TRAJ_T) && !(ended && ready == loaded))
+    {
+	underrun_count++;
+	ROS_WARN_THROTTLE(1, "Trajectory %s is being read too slowly",
+			  filename.c_str());
+    }
+
+    // the points well behind this segment won't be used again
+    if (i > first+STREAM_BEHIND+1)
+    {
+	first = i-STREAM_BEHIND-1;
+	if (loaded+STREAM_CHUNK-first <= STREAM_CAPACITY)
+	    space.notify_one();
+    }
+
+    float t0 = (*this)(i-1, TRAJ_T);
+    mult = (t-t0)/((*this)(i, TRAJ_T)-t0);
+    if (mult < 0)
+	mult = 0;
+    else if (mult > 1)
+	mult = 1;
+    return i;
+}
+
+
+// binary search for the first point after t, in [lo, hi]
+unsigned int TrajectoryStream::search(unsigned int lo, unsigned int hi,
+				      float t) const
+{
+    while (lo < hi)
+    {
+	unsigned int mid = (lo+hi)/2;
+	if ((*this)(mid, TRAJ_T) > t)
+	    hi = mid;
+	else
+	    lo = mid+1;
+    }
+    return lo;
+}
+
+
+bool TrajectoryStream::finished(float t)
+{
+    boost::mutex::scoped_lock lock(mutex);
+    return ended && ready == loaded &&
+	(ready == 0 || t > (*this)(ready-1, TRAJ_T));
+}
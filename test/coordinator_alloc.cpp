@@ -0,0 +1,247 @@
+// coordinator_alloc.cpp
+//
+// Once the coordinator is tracking, the frames it is handed should be
+// handled without allocating any memory.  This counts the calls to
+// operator new, and the allocations that Eigen makes itself, while a
+// fleet is tracked through a few hundred frames with the points
+// shuffled, a robot missing now and then, and clutter.
+//
+// The coordinator talks to the parameter server as it is built, so
+// this needs a master; it is run by coordinator_alloc.test.
+
+
+//---------------------------------------------------------------------------
+// Includes
+//---------------------------------------------------------------------------
+
+#include <new>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+
+// count the allocations, from here and from inside Eigen.  These have
+// to come before anything includes Eigen.
+static long new_count = 0;
+static long eigen_count = 0;
+static bool counting = false;
+
+// Eigen checks that it may allocate with an assertion, which this
+// counts instead of failing on; every other assertion still aborts.
+static void eigen_assert_failed(const char *cond, const char *file, int line)
+{
+    if (strstr(cond, "heap allocation is forbidden") != NULL)
+    {
+	eigen_count++;
+	return;
+    }
+    fprintf(stderr, "%s:%d: Eigen assertion failed: %s\n", file, line, cond);
+    abort();
+}
+
+#define EIGEN_RUNTIME_NO_MALLOC
+#define eigen_assert(x) \
+    do { if (!(x)) eigen_assert_failed(#x, __FILE__, __LINE__); } while (0)
+
+void *operator new(std::size_t n) throw(std::bad_alloc)
+{
+    if (counting)
+	new_count++;
+    void *p = std::malloc(n ? n : 1);
+    if (p == NULL)
+	throw std::bad_alloc();
+    return p;
+}
+void *operator new[](std::size_t n) throw(std::bad_alloc)
+{
+    if (counting)
+	new_count++;
+    void *p = std::malloc(n ? n : 1);
+    if (p == NULL)
+	throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) throw() { std::free(p); }
+void operator delete[](void *p) throw() { std::free(p); }
+
+#include <gtest/gtest.h>
+
+// the coordinator is a single file, so this is built with it, under
+// another name for its main()
+#define main coordinator_main
+#include "../src/multi_coordinator.cpp"
+#undef main
+
+
+//---------------------------------------------------------------------------
+// Global Variables
+//---------------------------------------------------------------------------
+#define TEST_RATE (30.0)        // frames per second
+#define TEST_FRAMES (300)
+#define TEST_WARMUP (60)        // frames before the counting starts
+#define TEST_TOLERANCE (0.05)   // meters
+
+
+//---------------------------------------------------------------------------
+// Tests
+//---------------------------------------------------------------------------
+
+class CoordinatorAlloc : public ::testing::Test
+{
+protected:
+    Coordinator *coord;
+    int nr;
+    std::vector<Eigen::Vector3d> pos, vel;
+    ros::Time stamp;
+    uint32_t seq;
+
+    CoordinatorAlloc() { coord = NULL; }
+    virtual void TearDown() { delete coord; }
+
+    // build a coordinator for num robots that is already calibrated.
+    // Its spinners are never started, so nothing else runs on its
+    // queues.
+    void start(int num)
+	{
+	    nr = num;
+	    srand(5);
+	    ros::param::set("/number_robots", nr);
+	    ros::param::set("~state_file", std::string(""));
+	    ros::param::set("~identify_robots", false);
+	    ros::param::set("~publish_on_data", false);
+	    ros::param::set("~frame_budget", 1.0);
+	    coord = new Coordinator;
+
+	    pos.resize(nr);
+	    vel.resize(nr);
+	    for (int i=0; i<nr; i++)
+	    {
+		pos[i] << 10.0*uniform()-5.0, 0, 3.0+10.0*uniform();
+		vel[i] << uniform()-0.5, 0, uniform()-0.5;
+	    }
+	    coord->operating_condition = 2;
+	    coord->gen_flag = false;
+	    coord->calibrated_flag = true;
+	    coord->cal_pos.setZero();
+	    coord->cal_rot.setIdentity();
+	    puppeteer_msgs::Robots r;
+	    r.robots.resize(nr);
+	    for (int i=0; i<nr; i++)
+	    {
+		r.robots[i].point.x = pos[i](0);
+		r.robots[i].point.y = pos[i](1);
+		r.robots[i].point.z = pos[i](2);
+	    }
+	    coord->reset_tracks(r);
+	    stamp = ros::Time::now();
+	    seq = 0;
+	}
+
+    double uniform(void) { return rand()/(double) RAND_MAX; }
+
+    // move the robots on by a frame, and make up what the kinect
+    // would see: the near side of each robot, in a random order,
+    // sometimes without the last of them, and one stray point
+    puppeteer_msgs::Robots::ConstPtr step(int k)
+	{
+	    double dt = 1.0/TEST_RATE;
+	    std::vector<int> perm(nr);
+	    for (int i=0; i<nr; i++)
+	    {
+		pos[i] += dt*vel[i];
+		perm[i] = i;
+	    }
+	    std::random_shuffle(perm.begin(), perm.end());
+	    int nd = (k%10 == 5) ? nr-1 : nr;
+
+	    puppeteer_msgs::Robots::Ptr r(new puppeteer_msgs::Robots);
+	    stamp = stamp+ros::Duration(dt);
+	    r->header.stamp = stamp;
+	    r->header.seq = ++seq;
+	    r->header.frame_id = "oriented_optimization_frame";
+	    r->robots.resize(nd+1);
+	    for (int i=0; i<=nd; i++)
+	    {
+		Eigen::Vector3d m;
+		if (i < nd)
+		{
+		    const Eigen::Vector3d &c = pos[perm[i]];
+		    m = c*(1.0-DEFAULT_RADIUS/c.norm());
+		}
+		else
+		    m << 10.0*uniform()-5.0, 0, 3.0+10.0*uniform();
+		r->robots[i].header.frame_id = r->header.frame_id;
+		r->robots[i].point.x = m(0);
+		r->robots[i].point.y = m(1);
+		r->robots[i].point.z = m(2);
+	    }
+	    r->number = nd+1;
+	    return r;
+	}
+
+    // how many of the robots are tracked further off than tol?
+    int misplaced(double tol)
+	{
+	    int bad = 0;
+	    for (int i=0; i<nr; i++)
+	    {
+		const geometry_msgs::Point &q =
+		    coord->current_bots_sorted.robots[i].point;
+		if ((Eigen::Vector3d(q.x, q.y, q.z)-pos[i]).norm() > tol)
+		    bad++;
+	    }
+	    return bad;
+	}
+
+    // track the fleet, counting the allocations in the coordinator
+    // once the warmup is over
+    void run(int num)
+	{
+	    start(num);
+	    int bad = 0;
+	    new_count = eigen_count = 0;
+	    Eigen::internal::set_is_malloc_allowed(true);
+	    for (int k=0; k<TEST_FRAMES; k++)
+	    {
+		ros::MessageEvent<puppeteer_msgs::Robots const>
+		    event(step(k), ros::Time::now());
+		if (k >= TEST_WARMUP)
+		{
+		    Eigen::internal::set_is_malloc_allowed(false);
+		    counting = true;
+		}
+		coord->datacb(event);
+		counting = false;
+		Eigen::internal::set_is_malloc_allowed(true);
+		if (k > 0)
+		    bad += misplaced(TEST_TOLERANCE);
+	    }
+
+	    EXPECT_EQ(0, bad);
+	    EXPECT_EQ(0, new_count);
+	    EXPECT_EQ(0, eigen_count);
+	}
+};
+
+
+TEST_F(CoordinatorAlloc, SmallFleet)
+{
+    run(10);
+}
+
+
+TEST_F(CoordinatorAlloc, LargeFleet)
+{
+    run(80);
+}
+
+
+//---------------------------------------------------------------------------
+// Main
+//---------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    ros::init(argc, argv, "coordinator_alloc");
+    return RUN_ALL_TESTS();
+}